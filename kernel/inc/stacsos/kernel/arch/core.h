@@ -12,6 +12,8 @@
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/alg/cfs.h>
+#include <stacsos/kernel/sched/alg/realtime.h>
 #include <stacsos/kernel/sched/alg/rr.h>
 #include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
 #include <stacsos/kernel/sched/alg/sfs.h>
@@ -26,6 +28,15 @@ class core_manager;
 
 enum class core_status { offline, online, error, bootstrap };
 
+// How an idle core waits for work: spinning, halting until the next interrupt, or using
+// MONITOR/MWAIT on its runqueue so that an enqueue from another core wakes it directly.
+enum class idle_mode { poll, halt, mwait };
+
+// The kinds of inter-processor interrupt that cores send each other.
+enum class ipi_kind { reschedule, call_function, tlb_shootdown };
+
+typedef void (*cross_call_fn)(void *arg);
+
 class core {
 	friend class core_manager;
 
@@ -41,9 +52,16 @@ public:
 		, sched_alg_(nullptr)
 		, clock_(0)
 		, last_clock_(0)
+		, nr_runnable_(0)
+		, nr_evicted_(0)
+		, idle_mode_(idle_mode::poll)
+		, quantum_(0)
+		, slice_start_(0)
+		, slice_length_(0)
+		, running_idle_(true)
+		, running_rt_priority_(-1)
 	{
-		idle_thread_.entity = nullptr;
-		idle_thread_.mcontext = nullptr;
+		memops::bzero(&idle_thread_, sizeof(idle_thread_));
 
 		//*new alg::simple_fair_scheduler()
 
@@ -54,6 +72,8 @@ public:
 
 		if (memops::strcmp(sched_alg_name, "sfs") == 0) {
 			sched_alg_ = new alg::simple_fair_scheduler();
+		} else if (memops::strcmp(sched_alg_name, "cfs") == 0) {
+			sched_alg_ = new alg::completely_fair_scheduler();
 		} else if (memops::strcmp(sched_alg_name, "rr") == 0) {
 			sched_alg_ = new alg::round_robin();
 		} else {
@@ -72,32 +92,33 @@ public:
 
 	virtual timer &local_timer() = 0;
 
-	void add_to_runqueue(tcb &tcb)
-	{
-		u64 flags;
-
-		// TODO: This lock is wrong for MP.
-		rq_lock_.lock(&flags);
-		sched_alg_->add_to_runqueue(tcb);
-		rq_lock_.unlock(flags);
-	}
+	// The frequency (in Hz) of the clock used for scheduler accounting.
+	virtual u64 clock_frequency() const = 0;
 
-	void remove_from_runqueue(tcb &tcb)
-	{
-		u64 flags;
+	void add_to_runqueue(tcb &tcb);
+	bool remove_from_runqueue(tcb &tcb);
+	bool set_task_priority(tcb &tcb, sched_policy policy, int priority);
+	bool set_task_affinity(tcb &tcb, u64 affinity);
 
-		// TODO: This lock is wrong for MP.
-		rq_lock_.lock(&flags);
-		sched_alg_->remove_from_runqueue(tcb);
-		rq_lock_.unlock(flags);
-	}
+	// The number of tasks on this core's runqueue (including the one that is running).  This
+	// is read without the runqueue lock, so it's only a hint.
+	u64 nr_runnable() const { return *(volatile u64 *)&nr_runnable_; }
 
 	void schedule();
+	void tick();
+
+	// Sends an inter-processor interrupt of the given kind to this core, from the executing core.
+	virtual void send_ipi(ipi_kind kind) = 0;
+
+	// Runs the given function on this core (in interrupt context), and waits for it to complete.
+	void call(cross_call_fn fn, void *arg);
+	void run_pending_calls();
 
 	virtual void set_current_tcb(const tcb *tcb) = 0;
 	virtual tcb *get_current_tcb() = 0;
 
 	core_status status() const { return status_; }
+	bool is_online() const { return status_ == core_status::online || status_ == core_status::bootstrap; }
 
 	irq_manager &irqs() { return irqs_; }
 	const irq_manager &irqs() const { return irqs_; }
@@ -111,10 +132,51 @@ private:
 
 	tcb idle_thread_;
 	alg::scheduling_algorithm *sched_alg_;
+	alg::realtime_scheduler rt_sched_alg_;
 
 	u64 clock_;
 	u64 last_clock_;
 
 	spinlock_irq rq_lock_;
+	u64 nr_runnable_;
+
+	// Tasks that have been taken off this core's runqueue because their affinity no longer
+	// allows them here, but that haven't yet been moved to another core.
+	list<tcb *> evicted_;
+	u64 nr_evicted_;
+
+	idle_mode idle_mode_;
+
+	u64 quantum_; // In clock ticks
+	u64 slice_start_;
+	u64 slice_length_;
+
+	// What this core is running, so that other cores can tell whether a task they place here
+	// should preempt it.  These are only hints.
+	volatile bool running_idle_;
+	volatile int running_rt_priority_; // -1 if not running a real-time task
+
+	struct cross_call {
+		cross_call_fn fn;
+		void *arg;
+		volatile bool done;
+	};
+
+	spinlock_irq calls_lock_;
+	list<cross_call *> calls_;
+
+	static void idle_thread();
+	__noreturn void idle();
+	void select_idle_mode();
+
+	alg::scheduling_algorithm &algorithm_for(const tcb &tcb);
+	tcb *pick_next_task(tcb *current);
+	tcb *steal_task(tcb *current);
+	void push_evicted_tasks();
+	bool cancel_eviction(tcb &tcb);
+	void migrate_task(core &from, tcb &tcb);
+
+	bool should_preempt_for(const tcb &tcb) const;
+	void kick_idle_core(const tcb &tcb);
 };
 } // namespace stacsos::kernel::arch
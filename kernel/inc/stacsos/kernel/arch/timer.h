@@ -30,6 +30,14 @@ public:
 	virtual void start(u64 period) = 0;
 	virtual void stop() = 0;
 
+	// Re-evaluates when the timer should next fire, e.g. because a new, earlier, deadline
+	// has been registered.
+	virtual void rearm() = 0;
+
+	// Enables or disables the periodic scheduler tick.  With the tick disabled the timer only
+	// fires for sleep deadlines, which lets an idle core stay halted.
+	virtual void set_tick(bool enabled) = 0;
+
 private:
 	timer_callback cb_;
 	void *cb_arg_;
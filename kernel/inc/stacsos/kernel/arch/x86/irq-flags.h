@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::arch::x86 {
+
+/**
+ * Disables interrupts on this core, and returns the previous RFLAGS so that they can be put back
+ * with local_irq_restore.  Nothing else (e.g. other cores) is stopped, so this is not a lock: it's
+ * for per-core state, and for keeping the caller on this core.
+ */
+static inline u64 local_irq_save()
+{
+	u64 flags;
+	asm volatile("pushf; pop %0; cli" : "=r"(flags)::"memory");
+	return flags;
+}
+
+/**
+ * Restores the RFLAGS saved by local_irq_save, re-enabling interrupts if they were enabled then.
+ */
+static inline void local_irq_restore(u64 flags) { asm volatile("push %0; popf" ::"r"(flags) : "memory", "cc"); }
+
+} // namespace stacsos::kernel::arch::x86
@@ -12,10 +12,20 @@
 
 namespace stacsos::kernel::arch::x86 {
 
+/**
+ * The local APIC timer.  This runs in one-shot mode, and is programmed to fire at whichever
+ * comes first: the next scheduler tick, or the earliest sleep deadline on this core.  The
+ * tick can be switched off (e.g. while the core is idle), in which case only sleep deadlines
+ * are programmed.
+ */
 class x2apic_timer : public timer {
 public:
 	x2apic_timer(x2apic &lapic)
 		: lapic_(lapic)
+		, running_(false)
+		, tick_enabled_(true)
+		, tick_period_(0)
+		, next_tick_(0)
 	{
 	}
 
@@ -23,19 +33,20 @@ public:
 
 	virtual void init() override;
 
-	virtual void start(u64 frequency)
-	{
-		lapic_.set_timer_periodic();
-		lapic_.set_timer_divide(3);
-		lapic_.set_timer_initial_count((lapic_.get_timer_frequency() >> 4) / frequency);
-
-		lapic_.unmask_interrupts(x2apic_lvts::timer);
-	}
-
-	virtual void stop() { lapic_.mask_interrupts(x2apic_lvts::timer); }
+	virtual void start(u64 frequency) override;
+	virtual void stop() override;
+	virtual void rearm() override;
+	virtual void set_tick(bool enabled) override;
 
 private:
 	static void timer_irq_handler(u8 irq, void *context, void *arg);
 	x2apic &lapic_;
+
+	bool running_;
+	bool tick_enabled_;
+	u64 tick_period_; // In TSC ticks
+	u64 next_tick_; // TSC value
+
+	void program(u64 deadline);
 };
 } // namespace stacsos::kernel::arch::x86
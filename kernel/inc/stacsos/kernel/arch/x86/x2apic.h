@@ -138,6 +138,18 @@ public:
 		set_icr(v);
 	}
 
+	void send_ipi(u32 target, u8 vector)
+	{
+		x2apic_icr v;
+
+		v.destination = target;
+		v.vector = vector;
+		v.delivery_mode = icr_delivery_mode::fixed;
+		v.level = icr_level::assert;
+
+		set_icr(v);
+	}
+
 	x86_core &owner() const { return owner_; }
 
 private:
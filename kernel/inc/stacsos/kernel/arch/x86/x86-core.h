@@ -26,7 +26,12 @@ public:
 		, irqs_(idt_)
 		, lapic_(*this)
 		, timer_(lapic_)
+		, pcid_enabled_(false)
+		, active_cr3_(0)
+		, next_pcid_slot_(0)
+		, tlb_shootdown_pending_(false)
 	{
+		memops::bzero(pcid_slots_, sizeof(pcid_slots_));
 	}
 
 	static int this_core_id() { return core::this_core_id(); }
@@ -36,6 +41,7 @@ public:
 	virtual bool remote_run() override;
 
 	virtual timer &local_timer() override { return timer_; }
+	virtual u64 clock_frequency() const override { return tsc_.frequency(); }
 
 	tsc &local_tsc() { return tsc_; }
 
@@ -45,6 +51,19 @@ public:
 	virtual void set_current_tcb(const tcb *tcb) override;
 	virtual tcb *get_current_tcb() override;
 
+	virtual void send_ipi(ipi_kind kind) override;
+
+	// Passing this as the CR3 to flush_tlb flushes the range in every address space, e.g. for a
+	// change to the kernel's part of the address space.
+	static const u64 all_address_spaces = 0;
+
+	// Invalidates the TLB entries for a range of pages in the given address space on every
+	// online core, and waits until they've all done so.
+	static void flush_tlb(u64 cr3, u64 address, u64 nr_pages);
+
+	// Whether any core currently has the given page tables loaded.
+	static bool is_address_space_active(u64 cr3);
+
 	x2apic &lapic() { return lapic_; }
 	tsc &timestamp_counter() { return tsc_; }
 
@@ -64,6 +83,12 @@ private:
 		u64 context_ptr;
 		u64 cr3;
 		u64 kernel_stack;
+		u64 user_stack_save;
+		u64 start_time;
+		u64 stop_time;
+		u64 run_time;
+		u64 live;
+		u64 prev;
 	} temporary_tcb;
 
 	irq::irq_manager<256> irqs_;
@@ -72,6 +97,29 @@ private:
 	x2apic_timer timer_;
 	tsc tsc_;
 
+	// When PCIDs are available, the TLB entries of the last few address spaces to run on this core
+	// are kept around.  Each slot holds the CR3 of an address space, which is tagged with PCID
+	// (slot + 1); PCID 0 is left for the boot-time page tables.  Note that this relies on CR3 values
+	// not being recycled for a different address space while they are still in a slot.
+	static const int nr_pcid_slots = 8;
+
+	bool pcid_enabled_;
+	u64 active_cr3_;
+	u64 pcid_slots_[nr_pcid_slots];
+	int next_pcid_slot_;
+
+	void init_pcid();
+	void switch_address_space(u64 cr3);
+
+	volatile bool tlb_shootdown_pending_;
+
+	void flush_tlb_local(u64 cr3, u64 address, u64 nr_pages);
+	void handle_tlb_shootdown();
+
+	static void reschedule_irq_handler(u8 irq, void *context, void *arg);
+	static void call_function_irq_handler(u8 irq, void *context, void *arg);
+	static void tlb_shootdown_irq_handler(u8 irq, void *context, void *arg);
+
 	static void exception_handler(u8 irq, void *context, void *arg)
 	{
 		switch (irq) {
@@ -90,8 +138,9 @@ private:
 	}
 
 	void populate_dt();
-	// pfn_t prepare_mpstartup_code();
-	// void complete_remote_init();
+	pfn_t prepare_mpstartup_code();
+	static __noreturn void remote_entry(x86_core *core);
+	__noreturn void complete_remote_init();
 
 	void handle_gpf(machine_context *mc);
 	void handle_page_fault(machine_context *mc);
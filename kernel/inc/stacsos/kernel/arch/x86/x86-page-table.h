@@ -8,9 +8,11 @@
 #pragma once
 
 #include <stacsos/kernel/arch/x86/page-table-structures.h>
+#include <stacsos/list.h>
 
 namespace stacsos::kernel::mem {
 class page_table_allocator;
+class page;
 }
 
 namespace stacsos::kernel::arch::x86 {
@@ -24,6 +26,8 @@ enum class mapping_result { ok, unmapped };
 struct mapping {
 	mapping_result result;
 	u64 address;
+	mapping_flags flags;
+	mapping_size size;
 };
 
 class x86_page_table {
@@ -88,6 +92,18 @@ public:
 	 */
 	void map(mem::page_table_allocator &pta, u64 virtual_address, u64 physical_address, mapping_flags flags, mapping_size size = mapping_size::m4k);
 
+	/**
+	 * @brief Maps a physically contiguous range of pages, using 2M (or 1G) mappings for any parts of the
+	 * range where the virtual and physical addresses are both suitably aligned.
+	 *
+	 * @param pta The allocator to use for allocating page tables.
+	 * @param virtual_address The (page aligned) virtual address of the start of the range.
+	 * @param physical_address The (page aligned) physical address of the start of the range.
+	 * @param nr_pages The number of 4K pages in the range.
+	 * @param flags The flags (i.e. permissions, etc) to use for the mappings.
+	 */
+	void map_range(mem::page_table_allocator &pta, u64 virtual_address, u64 physical_address, u64 nr_pages, mapping_flags flags);
+
 	/**
 	 * @brief Removes the mapping for a virtual address from the page table.
 	 *
@@ -96,14 +112,44 @@ public:
 	 */
 	void unmap(mem::page_table_allocator &pta, u64 virtual_address);
 
+	/**
+	 * @brief Detaches the page tables under a range of addresses that no longer map anything.  They are not freed, as other
+	 * cores may still be walking them until their TLBs have been flushed, but are added to the given list instead.  The tables
+	 * directly under the upper (kernel) half of the top level are shared by every address space, so are always left in place.
+	 *
+	 * @param virtual_address The (page aligned) virtual address of the start of the range.
+	 * @param nr_pages The number of 4K pages in the range.
+	 * @param tables The list to add the detached page tables to.
+	 */
+	void prune(u64 virtual_address, u64 nr_pages, list<mem::page *> &tables);
+
+	/**
+	 * @brief Frees this page table, along with every table below the lower (user) half of it.  The upper half belongs to the
+	 * page table this one was linked from, so is left alone.  This page table must not be in use on any core.
+	 *
+	 * @param pta The allocator that the page tables were allocated from.
+	 */
+	void destroy(mem::page_table_allocator &pta);
+
 	/**
 	 * @brief Looks up an existing mapping (if it exists) and returns details about it.
 	 *
 	 * @param virtual_address The virtual address to look up the mapping for.  This does NOT need to be page aligned.
-	 * @return mapping A mapping object, containing either an error, or the resulting address of the mapping if it exists.
+	 * @return mapping A mapping object, containing either an error, or the resulting address (and flags, and page size) of the mapping
+	 * if it exists.
 	 */
 	mapping get_mapping(u64 virtual_address);
 
+	/**
+	 * @brief Checks whether a page of the given size could be mapped at a virtual address, i.e. nothing is mapped anywhere in the
+	 * page of that size that contains it (and, for a large page, there is no page table in its place either).
+	 *
+	 * @param virtual_address The virtual address to check.  This does NOT need to be aligned.
+	 * @param size The size of the page to check for.
+	 * @return true if the page is completely unmapped.
+	 */
+	bool is_unmapped(u64 virtual_address, mapping_size size);
+
 	void dump() const;
 
 	u64 effective_cr3() const { return (u64)&pml4_ - 0xffff'8000'0000'0000; }
@@ -42,6 +42,8 @@ public:
 		return dfl;
 	}
 
+	u64 get_option_u64(const char *name, u64 dfl) const;
+
 private:
 	char command_line_[256];
 	config_option options_[32];
@@ -56,6 +56,7 @@ public:
 
 	virtual ~fat_node() { }
 
+	virtual u64 size() const override { return data_size_; }
 	virtual shared_ptr<file> open() override { return shared_ptr<file>(new fat_file((fat_filesystem &)fs(), cluster_, data_size_)); }
 	virtual fs_node *mkdir(const char *name) override;
 
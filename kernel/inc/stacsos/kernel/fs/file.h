@@ -19,6 +19,9 @@ public:
 
 	virtual ~file() { }
 
+	u64 size() const { return size_; }
+	u64 cur_offset() const { return cur_offset_; }
+
 	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) { return 0; }
 
 	virtual size_t pread(void *buffer, size_t offset, size_t length) = 0;
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/memory.h>
 #include <stacsos/string.h>
 
@@ -16,6 +17,7 @@ enum class fs_node_kind { file, directory };
 
 class filesystem;
 class file;
+class page_cache;
 
 class fs_node {
 public:
@@ -25,6 +27,7 @@ public:
 		, kind_(kind)
 		, mounted_fs_(nullptr)
 		, name_(name)
+		, cache_(nullptr)
 	{
 	}
 
@@ -39,9 +42,15 @@ public:
 
 	const string &name() const { return name_; }
 
+	// The current size of the node's contents, for nodes that are backed by data.
+	virtual u64 size() const { return 0; }
+
 	virtual shared_ptr<file> open() = 0;
 	virtual fs_node *mkdir(const char *name) = 0;
 
+	page_cache *cache();
+	void update_cache(const void *buffer, u64 offset, u64 length);
+
 protected:
 	virtual fs_node *resolve_child(const string &name) { return nullptr; }
 
@@ -51,5 +60,8 @@ private:
 	fs_node_kind kind_;
 	filesystem *mounted_fs_;
 	string name_;
+
+	spinlock_irq cache_lock_;
+	page_cache *cache_;
 };
 } // namespace stacsos::kernel::fs
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/map.h>
+#include <stacsos/memory.h>
+
+namespace stacsos::kernel::mem {
+class page;
+}
+
+namespace stacsos::kernel::fs {
+/**
+ * Caches the contents of a file, a page at a time, so that it can be mapped into address spaces.
+ * Pages are read from the file the first time they are asked for, and then stay cached -- and
+ * shared by every mapping of the file -- until memory runs short and nothing has them mapped.
+ */
+class page_cache {
+public:
+	page_cache(fs_node &node, shared_ptr<file> file)
+		: node_(node)
+		, file_(file)
+	{
+	}
+
+	// The node is asked each time, as the file may have changed size since the cache was made.
+	u64 size() const { return node_.size(); }
+
+	mem::page *get_page(u64 index);
+	void update(const void *buffer, u64 offset, u64 length);
+	u64 release_unused_pages();
+
+private:
+	fs_node &node_;
+	shared_ptr<file> file_;
+
+	spinlock_irq lock_;
+	map<u64, u64> pages_;
+};
+} // namespace stacsos::kernel::fs
@@ -61,6 +61,7 @@ public:
 	{
 	}
 
+	virtual u64 size() const override { return data_size_; }
 	virtual shared_ptr<file> open() override { return shared_ptr<file>(new tarfs_file((tar_filesystem &)fs(), data_start_, data_size_)); }
 	virtual fs_node *mkdir(const char *name) override;
 
@@ -8,6 +8,8 @@
 #pragma once
 
 #include <stacsos/kernel/fs/filesystem.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/list.h>
 
 namespace stacsos::kernel::fs {
 
@@ -19,8 +21,14 @@ private:
 
 	root_filesystem rootfs_;
 
+	spinlock_irq caches_lock_;
+	list<page_cache *> caches_;
+
 public:
 	void init();
 	fs_node *lookup(const char *path);
+
+	void register_cache(page_cache &cache);
+	u64 release_cached_pages();
 };
 } // namespace stacsos::kernel::fs
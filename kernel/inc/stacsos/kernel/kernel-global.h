@@ -8,5 +8,6 @@
 #pragma once
 
 static inline void *phys_to_virt(unsigned long phys_addr) { return (void *)(phys_addr + 0xffff'8000'0000'0000); }
+static inline unsigned long virt_to_phys(const void *virt_addr) { return (unsigned long)virt_addr - 0xffff'8000'0000'0000; }
 
 using pfn_t = unsigned long int;
@@ -7,10 +7,17 @@
  */
 #pragma once
 
+namespace stacsos::kernel::fs {
+class page_cache;
+}
+
 namespace stacsos::kernel::mem {
 class page;
 
-enum class region_flags { inaccessible = 0, readable = 1, writable = 2, executable = 4, readwrite = 3, all = 7 };
+// large_pages asks for a demand-populated region to be backed with 2M pages wherever a whole one
+// fits, rather than a 4K page at a time.  That's faster for memory that will all be used, but costs
+// 2M for every block that is touched at all -- so it's only for regions that are known to be dense.
+enum class region_flags { inaccessible = 0, readable = 1, writable = 2, executable = 4, readwrite = 3, all = 7, large_pages = 8 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(region_flags)
 
@@ -19,5 +26,14 @@ public:
 	u64 base, size;
 	region_flags flags;
 	page *storage;
+
+	// Unique within the address space, so that a fault handler working from a copy of the region
+	// can tell whether it is still there, or has been removed (and perhaps replaced).
+	u64 id;
+
+	// If set, the region maps a file, starting at the given (page aligned) offset, and its pages
+	// come from the file's page cache.
+	fs::page_cache *cache;
+	u64 cache_offset;
 };
 } // namespace stacsos::kernel::mem
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/address-space-region.h>
 #include <stacsos/kernel/mem/page-table.h>
 #include <stacsos/list.h>
@@ -23,26 +24,27 @@ public:
 		: pta_(pta)
 		, pt_(page_table::create_empty(pta))
 		, next_alloc_rgn_(alloc_rgn_start)
+		, next_region_id_(0)
 	{
 	}
 
-	~address_space() { panic("free addrspace"); }
+	~address_space();
 
 	page_table &pgtable() const { return *pt_; }
 
 	address_space_region *alloc_region(u64 size, region_flags flags, bool allocate);
 	address_space_region *add_region(u64 base, u64 size, region_flags flags, bool allocate);
-	void remove_region(u64 base, u64 size, region_flags flags);
+	address_space_region *map_file(fs::page_cache &cache, u64 offset, u64 size, region_flags flags);
+	bool remove_region(u64 base);
+
+	bool populate(u64 address);
+
+	address_space *clone();
 
 	address_space_region *get_region_from_address(u64 address)
 	{
-		for (address_space_region *rgn : regions_) {
-			if (address >= rgn->base && address < (rgn->base + rgn->size)) {
-				return rgn;
-			}
-		}
-
-		return nullptr;
+		unique_irq_lock l(lock_);
+		return find_region(address);
 	}
 
 	address_space *create_linked(u64 alloc_rgn_start);
@@ -52,13 +54,36 @@ private:
 		: pta_(pta)
 		, pt_(pt)
 		, next_alloc_rgn_(alloc_rgn_start)
+		, next_region_id_(0)
+	{
+	}
+
+	address_space_region *find_region(u64 address)
 	{
+		for (address_space_region *rgn : regions_) {
+			if (address >= rgn->base && address < (rgn->base + rgn->size)) {
+				return rgn;
+			}
+		}
+
+		return nullptr;
 	}
 
+	u64 reserve_range(u64 size);
+	void release_region(address_space_region *rgn);
+	bool can_populate(const address_space_region &rgn, u64 address, mapping_size size);
+	bool populate_zeroed(const address_space_region &rgn, u64 address, mapping_size size, mapping_flags flags);
+	bool populate_from_cache(const address_space_region &rgn, u64 page_address);
+	bool copy_on_write(u64 page_address, u64 shared_address);
+
 	page_table_allocator &pta_;
 	page_table *pt_;
 
+	// Threads of the same process may be running on different cores, so this protects the
+	// region list, the allocation pointer, the region ids, and the page tables.
+	spinlock_irq lock_;
 	list<address_space_region *> regions_;
 	u64 next_alloc_rgn_;
+	u64 next_region_id_;
 };
 } // namespace stacsos::kernel::mem
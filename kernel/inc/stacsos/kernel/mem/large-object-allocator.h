@@ -7,15 +7,22 @@
  */
 #pragma once
 
+#include <stacsos/avl-tree.h>
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
 
 namespace stacsos::kernel::mem {
-struct object_header {
-	u64 size;
-	u8 data[];
-};
-
+/**
+ * Allocates objects too big for the slabs, by mapping whole pages into a dedicated region of the
+ * kernel's address space.
+ *
+ * Freeing is done in two steps: free() just retires the extent, and reclaim() -- called when the
+ * core is idle, or when memory is short -- unmaps it, shoots down any stale TLB entries, and only
+ * then hands the pages and the virtual range back for reuse.  The TLB shootdown has to wait for
+ * every other core, which can't be done safely from an arbitrary free() call site that may be
+ * holding a lock another core is spinning on (with interrupts disabled).
+ */
 class large_object_allocator {
 public:
 	large_object_allocator(void *region_base, size_t region_size)
@@ -28,11 +35,23 @@ public:
 	void *allocate(size_t size);
 	bool free(void *ptr);
 
+	u64 reclaim();
+
 	bool ptr_in_region(void *ptr) const { return ((uintptr_t)ptr >= (uintptr_t)region_base_) && ((uintptr_t)ptr < ((uintptr_t)region_base_ + size_)); }
 
 private:
+	u64 reserve_range(u64 nr_pages);
+	void release_range(u64 start, u64 nr_pages);
+
+	spinlock_irq lock_;
+
 	void *region_base_;
 	void *base_;
 	size_t size_;
+
+	// Extents, keyed on starting address, with their size in pages.
+	avl_tree<u64, u64> allocated_;
+	avl_tree<u64, u64> retired_;
+	avl_tree<u64, u64> free_;
 };
 } // namespace stacsos::kernel::mem
@@ -13,12 +13,15 @@
 #include <stacsos/kernel/mem/page-table-allocator.h>
 
 namespace stacsos::kernel::mem {
+class page_frame_cache;
+
 class memory_manager {
 	DEFINE_SINGLETON(memory_manager)
 
 private:
 	memory_manager()
 		: pgalloc_(nullptr)
+		, pgcache_(nullptr)
 		, root_address_space_(nullptr)
 	{
 	}
@@ -40,6 +43,11 @@ public:
 
 	bool try_handle_page_fault(u64 faulting_address);
 
+	bool do_idle_work();
+	u64 reclaim_memory();
+
+	void perform_large_object_selftest();
+
 private:
 	void initialise_page_descriptors(u64 nr_page_descriptors);
 	void initialise_page_allocator(u64 nr_page_descriptors);
@@ -47,6 +55,7 @@ private:
 	void activate_primary_mapping();
 
 	page_allocator *pgalloc_;
+	page_frame_cache *pgcache_;
 	page_table_allocator ptalloc_;
 	object_allocator objalloc_;
 
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/large-object-allocator.h>
 #include <stacsos/kernel/mem/slab-cache.h>
@@ -22,16 +23,71 @@ public:
 	void *realloc(void *obj, size_t size);
 	void free(void *obj);
 
+	u64 shrink();
+	u64 reclaim_large_objects();
+
 private:
+	static const int nr_size_classes = 14;
+	static const size_t max_slab_object_size = 4096;
+	static const u32 magazine_size = 16;
+
+	/**
+	 * A stack of free objects of one size class, owned by one core.
+	 */
+	struct magazine {
+		void *rounds[magazine_size];
+		u32 count;
+	};
+
+	/**
+	 * Each core has two magazines per size class: objects come from and go to the loaded one,
+	 * and the other is swapped in when the loaded one runs dry (or fills up), so that a core
+	 * bouncing around a boundary doesn't hit the slabs every time.
+	 */
+	struct core_magazines {
+		magazine mags[nr_size_classes][2];
+		u8 loaded[nr_size_classes];
+	};
+
+	static int size_class(size_t size);
+	static u32 magazine_rounds(int cls);
+
+	/**
+	 * Holds the allocator lock, and remembers which core has it -- so that a page allocation made
+	 * while holding it can't end up back here (via shrink) and deadlock.
+	 */
+	class owned_lock {
+	public:
+		owned_lock(object_allocator &oa);
+		~owned_lock();
+
+	private:
+		object_allocator &oa_;
+		u64 flags_;
+	};
+
+	void refill(int cls, magazine &m);
+	void flush(magazine &m);
+
 	spinlock_irq object_allocator_lock_;
+	volatile int lock_owner_;
+	core_magazines magazines_[arch::core_manager::max_cores];
+	slab_cache_base *caches_[nr_size_classes];
 
 	slab_cache<16, 0> cache16_;
 	slab_cache<32, 0> cache32_;
+	slab_cache<48, 0> cache48_;
 	slab_cache<64, 0> cache64_;
+	slab_cache<96, 0> cache96_;
 	slab_cache<128, 0> cache128_;
+	slab_cache<192, 0> cache192_;
 	slab_cache<256, 0> cache256_;
+	slab_cache<384, 0> cache384_;
 	slab_cache<512, 0> cache512_;
-	slab_cache<1024, 0> cache1024_;
+	slab_cache<768, 1> cache768_;
+	slab_cache<1024, 1> cache1024_;
+	slab_cache<2048, 2> cache2048_;
+	slab_cache<4096, 3> cache4096_;
 	large_object_allocator loa_;
 };
 } // namespace stacsos::kernel::mem
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
@@ -17,9 +18,14 @@ class page_allocator_buddy : public page_allocator {
 public:
 	page_allocator_buddy(memory_manager &mm)
 		: page_allocator(mm)
+		, nonempty_orders_(0)
+		, pfn_limit_(0)
+		, total_pages_(0)
+		, free_pages_(0)
 	{
-		for (int i = 0; i <= LAST_ORDER; i++) {
+		for (order_t i = 0; i <= LAST_ORDER; i++) {
 			free_list_[i] = INVALID_PFN;
+			nr_free_blocks_[i] = 0;
 		}
 	}
 
@@ -28,21 +34,44 @@ public:
 	virtual page_allocation_result allocate_pages(order_t order, page_allocation_flags flags = page_allocation_flags::none) override;
 	virtual page_allocator_error free_pages(pfn_t range_start, order_t order) override;
 
+	virtual u64 allocate_batch(order_t order, pfn_t *blocks, u64 count) override;
+	virtual u64 free_batch(order_t order, const pfn_t *blocks, u64 count) override;
+
 	virtual void dump() const override;
-	virtual page_allocator_stats get_stats() const override;
+	virtual page_allocator_stats get_stats() const override { return page_allocator_stats { total_pages_ - free_pages_, free_pages_ }; }
 
 private:
 	static const order_t LAST_ORDER = 16;
 
+	spinlock_irq lock_;
+
+	// The heads of the (doubly linked, via the page descriptors) free lists for each order.
 	pfn_t free_list_[LAST_ORDER + 1];
+	u64 nr_free_blocks_[LAST_ORDER + 1];
+
+	// Bit N is set if the free list for order N is non-empty.
+	u32 nonempty_orders_;
+
+	// One past the highest PFN we've ever been given, so we never look at a page descriptor that
+	// doesn't exist when checking for a buddy.
+	pfn_t pfn_limit_;
 
-	constexpr u64 pages_per_block(order_t order) const { return 1 << order; }
-	constexpr bool block_aligned(order_t order, pfn_t pfn) { return !(pfn & (pages_per_block(order) - 1)); }
+	u64 total_pages_;
+	u64 free_pages_;
+
+	constexpr u64 pages_per_block(order_t order) const { return 1ull << order; }
+	constexpr bool block_aligned(order_t order, pfn_t pfn) const { return !(pfn & (pages_per_block(order) - 1)); }
+	constexpr pfn_t buddy_of(order_t order, pfn_t pfn) const { return pfn ^ pages_per_block(order); }
+
+	bool is_free_block(order_t order, pfn_t block_start) const;
 
 	void insert_free_block(order_t order, pfn_t block_start);
 	void remove_free_block(order_t order, pfn_t block_start);
 
 	void split_block(order_t order, pfn_t block_start);
-	void merge_buddies(order_t order, pfn_t either_buddy);
+	pfn_t merge_buddies(order_t order, pfn_t either_buddy);
+
+	pfn_t allocate_block(order_t order);
+	page_allocator_error free_block(pfn_t block_start, order_t order);
 };
 } // namespace stacsos::kernel::mem
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
@@ -16,6 +17,8 @@ public:
 	page_allocator_linear(memory_manager &mm)
 		: page_allocator(mm)
 		, free_list_start_(0)
+		, total_pages_(0)
+		, free_pages_(0)
 	{
 	}
 
@@ -24,11 +27,17 @@ public:
 	virtual page_allocation_result allocate_pages(order_t order, page_allocation_flags flags = page_allocation_flags::none) override;
 	virtual page_allocator_error free_pages(pfn_t range_start, order_t order) override;
 
+	virtual u64 allocate_batch(order_t order, pfn_t *blocks, u64 count) override;
+
 	virtual void dump() const override;
 
 	virtual page_allocator_stats get_stats() const override { return page_allocator_stats { total_pages_ - free_pages_, free_pages_ }; }
 
 private:
+	void insert_free_range(pfn_t range_start, u64 page_count);
+	pfn_t take_block(order_t order);
+
+	spinlock_irq lock_;
 	pfn_t free_list_start_;
 	u64 total_pages_;
 	u64 free_pages_;
@@ -15,7 +15,10 @@ using order_t = u32;
 class page;
 class memory_manager;
 
-enum class page_allocation_flags { none = 0, zero = 1 };
+// reclaim: if memory has run out, the rest of the kernel may be asked to give some back (see
+// memory_manager::reclaim_memory), which can mean waiting for every other core.  Only pass this
+// when holding no locks.
+enum class page_allocation_flags { none = 0, zero = 1, reclaim = 2 };
 DEFINE_ENUM_FLAG_OPERATIONS(page_allocation_flags)
 
 enum class page_allocator_error { none, out_of_memory, order_out_of_range, page_not_aligned_with_order, not_implemented };
@@ -99,12 +102,18 @@ public:
 	virtual page_allocation_result allocate_pages(order_t order, page_allocation_flags flags = page_allocation_flags::none) = 0;
 	virtual page_allocator_error free_pages(pfn_t range_start, order_t order) = 0;
 
+	virtual u64 allocate_batch(order_t order, pfn_t *blocks, u64 count);
+	virtual u64 free_batch(order_t order, const pfn_t *blocks, u64 count);
+
 	virtual page_allocator_stats get_stats() const = 0;
 
 	virtual void dump() const = 0;
 
 	void perform_selftest();
 
+protected:
+	memory_manager &mm() const { return mm_; }
+
 private:
 	memory_manager &mm_;
 };
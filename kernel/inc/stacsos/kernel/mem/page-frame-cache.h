@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+
+/**
+ * A page allocator that sits in front of another page allocator, and keeps a small stash of
+ * free blocks of the lowest orders for each core.  Most allocations (page tables, slabs, etc.)
+ * are order-0, and can be satisfied from the local stash without touching the shared
+ * allocator (or its lock) at all.  The stash is refilled from, and drained back to, the
+ * backing allocator in batches.
+ *
+ * It also keeps a shared pool of blocks that have already been zeroed, which idle cores top up,
+ * so that allocations asking for zeroed memory don't have to clear it themselves.
+ */
+class page_frame_cache : public page_allocator {
+public:
+	page_frame_cache(memory_manager &mm, page_allocator &backing)
+		: page_allocator(mm)
+		, backing_(backing)
+	{
+		for (int i = 0; i < arch::core_manager::max_cores; i++) {
+			for (order_t order = 0; order < nr_cached_orders; order++) {
+				caches_[i].orders[order].count = 0;
+			}
+		}
+
+		for (order_t order = 0; order < nr_zeroed_orders; order++) {
+			zeroed_[order].count = 0;
+		}
+	}
+
+	virtual void insert_free_pages(pfn_t range_start, u64 page_count) override { backing_.insert_free_pages(range_start, page_count); }
+
+	virtual page_allocation_result allocate_pages(order_t order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual page_allocator_error free_pages(pfn_t range_start, order_t order) override;
+
+	virtual page_allocator_stats get_stats() const override;
+
+	virtual void dump() const override;
+
+	page_allocator &backing() const { return backing_; }
+
+	bool zero_idle_pages();
+
+private:
+	static const order_t nr_cached_orders = 3;
+	static const u64 max_cached_blocks = 64;
+
+	struct order_cache {
+		pfn_t blocks[max_cached_blocks];
+		u64 count;
+	};
+
+	struct core_cache {
+		order_cache orders[nr_cached_orders];
+	};
+
+	// Zeroed blocks are kept for orders up to (and including) 16-page kernel stacks.
+	static const order_t nr_zeroed_orders = 5;
+
+	// Don't hold on to zeroed blocks if it would leave the backing allocator with fewer free pages
+	// than this.
+	static const u64 zeroing_reserve_pages = 1024;
+
+	/**
+	 * The most blocks of an order that we keep on one core, before draining back.
+	 */
+	static u64 high_watermark(order_t order) { return max_cached_blocks >> order; }
+
+	/**
+	 * How many blocks of an order to move between a core and the backing allocator at once.
+	 */
+	static u64 batch_size(order_t order) { return 16 >> order; }
+
+	/**
+	 * How many pre-zeroed blocks of an order the idle cores try to keep around.
+	 */
+	static u64 zeroed_target(order_t order) { return order == 0 ? max_cached_blocks : 8; }
+
+	bool refill(order_cache &oc, order_t order);
+	void drain(order_cache &oc, order_t order, u64 count);
+
+	pfn_t take_zeroed_block(order_t order);
+	bool release_zeroed_blocks();
+	bool reclaim(page_allocation_flags flags);
+
+	page_allocator &backing_;
+	core_cache caches_[arch::core_manager::max_cores];
+
+	spinlock_irq zeroed_lock_;
+	order_cache zeroed_[nr_zeroed_orders];
+};
+} // namespace stacsos::kernel::mem
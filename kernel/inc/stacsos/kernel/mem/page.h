@@ -7,18 +7,20 @@
  */
 #pragma once
 
-extern "C" void *_DYNAMIC_DATA_START;
+extern "C" char _DYNAMIC_DATA_START[];
 
 namespace stacsos::kernel::mem {
 enum class page_type : u32 { none, reserved, system, allocable };
-enum class page_state : u32 { free, allocated };
+enum class page_state : u32 { none, free, allocated };
 
 class memory_manager;
 class page_allocator_buddy;
+class slab_cache_base;
 class page_allocator_linear;
 
 class page {
 	friend class memory_manager;
+	friend class page_allocator_buddy;
 
 public:
 	static page &get_from_pfn(pfn_t pfn) { return get_pagearray()[pfn]; }
@@ -28,15 +30,55 @@ public:
 	u64 base_address() const { return pfn() << PAGE_BITS; }
 	void *base_address_ptr() const { return (void *)(base_address() + 0xffff'8000'0000'0000ull); }
 
-	u64 refcount() const { return refcount_; }
-	void acquire() { refcount_++; }
-	bool release() { return !(refcount_--); }
+	// The reference count is the number of *additional* owners of the page, so that a freshly allocated
+	// page (with a count of zero) has exactly one.  Pages can be shared between address spaces that
+	// are running on different cores, so these are atomic.
+	u64 refcount() const { return __atomic_load_n(&refcount_, __ATOMIC_ACQUIRE); }
+	void acquire() { __atomic_add_fetch(&refcount_, 1, __ATOMIC_ACQ_REL); }
+
+	/**
+	 * Drops a reference to the page.  Returns true if the caller was the last owner, in which case it
+	 * is responsible for freeing the page.
+	 */
+	bool release()
+	{
+		u64 count = __atomic_load_n(&refcount_, __ATOMIC_ACQUIRE);
+		while (count > 0 && !__atomic_compare_exchange_n(&refcount_, &count, count - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { }
+
+		return count == 0;
+	}
+
+	slab_cache_base *slab_cache() const { return slab_cache_; }
+	void *slab() const { return slab_; }
+
+	void set_slab(slab_cache_base *cache, void *slab)
+	{
+		slab_cache_ = cache;
+		slab_ = slab;
+	}
 
 private:
-	static page *get_pagearray() { return reinterpret_cast<page *>(&_DYNAMIC_DATA_START); }
+	static page *get_pagearray() { return reinterpret_cast<page *>(_DYNAMIC_DATA_START); }
 
 	page_type type_;
 	page_state state_;
 	u64 refcount_;
+
+	// Only meaningful while this page is the first page of a free block in the buddy allocator,
+	// in which case state_ is page_state::free.
+	u32 free_order_;
+
+	union {
+		// While the page is free (in the buddy allocator)
+		struct {
+			pfn_t next_free_, prev_free_;
+		};
+
+		// While the page is part of a slab
+		struct {
+			slab_cache_base *slab_cache_;
+			void *slab_;
+		};
+	};
 };
 } // namespace stacsos::kernel::mem
@@ -12,7 +12,31 @@
 namespace stacsos::kernel::mem {
 enum class slab_state { empty, partial, full };
 
-template <size_t object_size, int slab_page_order> class slab_cache {
+/**
+ * The size-independent part of a slab cache.  Every page that belongs to a slab points (via its
+ * page descriptor) back at the cache that owns it, and at the slab itself, so an object can be
+ * freed without knowing which cache it came from, and without searching for it.
+ */
+class slab_cache_base {
+public:
+	virtual size_t slab_object_size() const = 0;
+
+	virtual void *allocate() = 0;
+	virtual void free(void *slab, void *ptr) = 0;
+	virtual u64 shrink() = 0;
+
+	static void free_object(void *ptr);
+
+protected:
+	// How many empty slabs a cache holds on to, to absorb the next burst of allocations, before
+	// giving them back to the page allocator.
+	static const u64 empty_slab_high_water = 2;
+
+	void *allocate_slab(int order);
+	void release_slab(void *slab_base, int order);
+};
+
+template <size_t object_size, int slab_page_order> class slab_cache : public slab_cache_base {
 private:
 	static const size_t slab_memory_size = ((1u << slab_page_order) * PAGE_SIZE);
 	static const size_t slab_object_capacity = slab_memory_size / object_size;
@@ -29,7 +53,9 @@ private:
 
 	public:
 		slab()
-			: next_(nullptr)
+			: prev_(nullptr)
+			, next_(nullptr)
+			, list_(slab_state::empty)
 			, used_count_(0)
 		{
 			for (u64 i = 0; i < reserved_objects; i++) {
@@ -40,7 +66,8 @@ private:
 
 		slab_state state() const
 		{
-			return (used_objects() == 0) ? slab_state::empty : ((used_objects() == capacity()) ? slab_state::full : slab_state::partial);
+			return (used_objects() == reserved_objects) ? slab_state::empty
+														: ((used_objects() == capacity()) ? slab_state::full : slab_state::partial);
 		}
 
 		size_t capacity() const { return slab_object_capacity; }
@@ -67,6 +94,10 @@ private:
 		{
 			u64 used_object = index_of(ptr);
 
+			if (used_object < reserved_objects || !used_[used_object]) {
+				panic("slab: invalid free of %p", ptr);
+			}
+
 			used_[used_object] = false;
 			used_count_--;
 		}
@@ -78,76 +109,138 @@ private:
 		object_index_type index_of(void *object_ptr) { return ((uintptr_t)object_ptr - (uintptr_t)this) / object_size; }
 
 	private:
-		slab *next_;
+		slab *prev_, *next_;
+		slab_state list_;
 		size_t used_count_;
 		stacsos::bitset<slab_object_capacity> used_;
 	};
 
 public:
 	slab_cache()
-		: slabs_(nullptr)
+		: lists_ { nullptr, nullptr, nullptr }
+		, nr_empty_(0)
 	{
 	}
 
-	void *allocate()
+	virtual size_t slab_object_size() const override { return object_size; }
+
+	virtual void *allocate() override
 	{
-		// Find a free slab
-		slab *s = slabs_;
-		while (s && s->state() == slab_state::full) {
-			s = s->next_;
+		// Prefer partially used slabs, so that empty ones can (eventually) be given back.  We never
+		// need to look at the full ones.
+		slab *s = lists_[(int)slab_state::partial];
+		if (!s) {
+			s = lists_[(int)slab_state::empty];
 		}
 
 		if (!s) {
 			// Allocate a new slab
-			void *slab_base = allocate_slab();
+			void *slab_base = allocate_slab(slab_page_order);
 			if (!slab_base) {
 				panic("out of memory");
 			}
 
 			s = new (slab_base) slab();
-			s->next_ = slabs_;
-			slabs_ = s;
+			push(s, slab_state::empty);
 		}
 
 		void *ptr = s->allocate();
+		update_list(s);
+
 		// dprintf("malloc: cache-size=%u, slab=%p, ptr=%p\n", object_size, s, ptr);
 		return ptr;
 	}
 
-	bool try_free(void *ptr)
+	virtual void free(void *slab_base, void *ptr) override
 	{
-		// Find containing slab
-		slab *s = slabs_;
-		while (s) {
-			if (s->contains_object(ptr)) {
-				break;
-			}
+		slab *s = (slab *)slab_base;
+		assert(s->contains_object(ptr));
+
+		s->free(ptr);
+		update_list(s);
+		// dprintf("free: ptr=%p\n", ptr);
 
-			s = s->next_;
+		if (nr_empty_ > empty_slab_high_water) {
+			release(lists_[(int)slab_state::empty]);
 		}
+	}
 
-		if (!s) {
-			return false;
+	/**
+	 * Gives every empty slab back to the page allocator.
+	 *
+	 * @return u64 The number of pages released.
+	 */
+	virtual u64 shrink() override
+	{
+		u64 released = 0;
+
+		while (lists_[(int)slab_state::empty]) {
+			release(lists_[(int)slab_state::empty]);
+			released += 1 << slab_page_order;
 		}
 
-		s->free(ptr);
-		// dprintf("free: ptr=%p\n", ptr);
+		return released;
+	}
 
-		// TODO: Free slabs?
+private:
+	slab *lists_[3];
+	u64 nr_empty_;
 
-		return true;
+	void push(slab *s, slab_state list)
+	{
+		if (list == slab_state::empty) {
+			nr_empty_++;
+		}
+
+		s->list_ = list;
+		s->prev_ = nullptr;
+		s->next_ = lists_[(int)list];
+
+		if (s->next_) {
+			s->next_->prev_ = s;
+		}
+
+		lists_[(int)list] = s;
 	}
 
-	void free(void *ptr)
+	void unlink(slab *s)
 	{
-		if (!try_free(ptr)) {
-			panic("object not in cache\n");
+		if (s->list_ == slab_state::empty) {
+			nr_empty_--;
+		}
+
+		if (s->prev_) {
+			s->prev_->next_ = s->next_;
+		} else {
+			lists_[(int)s->list_] = s->next_;
+		}
+
+		if (s->next_) {
+			s->next_->prev_ = s->prev_;
 		}
 	}
 
-private:
-	slab *slabs_;
+	/**
+	 * Returns an empty slab's memory to the page allocator.
+	 */
+	void release(slab *s)
+	{
+		assert(s->list_ == slab_state::empty);
 
-	void *allocate_slab();
+		unlink(s);
+		release_slab(s, slab_page_order);
+	}
+
+	/**
+	 * Moves a slab to the list matching its state, if it's changed.
+	 */
+	void update_list(slab *s)
+	{
+		slab_state state = s->state();
+		if (state != s->list_) {
+			unlink(s);
+			push(s, state);
+		}
+	}
 };
 } // namespace stacsos::kernel::mem
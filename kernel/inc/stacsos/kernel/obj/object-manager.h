@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stacsos/atomic.h>
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/obj/object.h>
 #include <stacsos/map.h>
 
@@ -28,6 +29,8 @@ private:
 public:
 	shared_ptr<object> get_object(sched::process &owner, u64 id)
 	{
+		unique_irq_lock l(lock_);
+
 		map<u64, shared_ptr<object>> *process_object_map;
 		if (!objects_.try_get_value(&owner, process_object_map)) {
 			return nullptr;
@@ -43,9 +46,9 @@ public:
 
 	void free_object(sched::process &owner, u64 id) { }
 
-	shared_ptr<object> create_file_object(sched::process &owner, shared_ptr<fs::file> file)
+	shared_ptr<object> create_file_object(sched::process &owner, shared_ptr<fs::file> file, fs::fs_node *node)
 	{
-		return register_object(owner, new file_object(allocate_id(owner), file));
+		return register_object(owner, new file_object(allocate_id(owner), file, node));
 	}
 
 	shared_ptr<object> create_process_object(sched::process &owner, shared_ptr<sched::process> proc)
@@ -60,12 +63,16 @@ public:
 
 private:
 	atomic_u64 next_id_;
+
+	spinlock_irq lock_;
 	map<sched::process *, map<u64, shared_ptr<object>> *> objects_;
 
 	u64 allocate_id(sched::process &owner) { return next_id_++; }
 
 	shared_ptr<object> register_object(sched::process &owner, object *o)
 	{
+		unique_irq_lock l(lock_);
+
 		map<u64, shared_ptr<object>> *process_object_map;
 		if (!objects_.try_get_value(&owner, process_object_map)) {
 			process_object_map = new map<u64, shared_ptr<object>>();
@@ -8,12 +8,16 @@
 #pragma once
 
 #include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/fs/page-cache.h>
 #include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/scheduler.h>
 #include <stacsos/kernel/sched/thread.h>
 #include <stacsos/memory.h>
+#include <stacsos/syscalls.h>
 
 namespace stacsos::kernel::obj {
-enum class operation_result_code : u64 { ok = 1, not_found = 2, not_supported = 3 };
+enum class operation_result_code : u64 { ok = 1, not_found = 2, not_supported = 3, invalid_argument = 4 };
 
 struct operation_result {
 	operation_result_code code;
@@ -21,6 +25,7 @@ struct operation_result {
 
 	static operation_result ok(u64 data = 0) { return operation_result { operation_result_code::ok, data }; }
 	static operation_result not_supported() { return operation_result { operation_result_code::not_supported, 0 }; }
+	static operation_result invalid_argument() { return operation_result { operation_result_code::invalid_argument, 0 }; }
 };
 
 class object {
@@ -36,6 +41,10 @@ public:
 	virtual operation_result ioctl(u64 cmd, void *buffer, size_t length) { return operation_result::not_supported(); }
 	virtual operation_result wait_for_status_change() { return operation_result::not_supported(); }
 	virtual operation_result join() { return operation_result::not_supported(); }
+	virtual operation_result set_priority(u64 priority_class, s64 priority) { return operation_result::not_supported(); }
+	virtual operation_result set_affinity(u64 affinity) { return operation_result::not_supported(); }
+	virtual operation_result get_affinity() { return operation_result::not_supported(); }
+	virtual operation_result mmap(mem::address_space &as, size_t offset, size_t length, bool writable) { return operation_result::not_supported(); }
 
 protected:
 	object(u64 id)
@@ -49,20 +58,56 @@ private:
 
 class file_object : public object {
 public:
-	file_object(u64 id, shared_ptr<fs::file> file)
+	file_object(u64 id, shared_ptr<fs::file> file, fs::fs_node *node)
 		: object(id)
 		, file_(file)
+		, node_(node)
 	{
 	}
 
 	virtual operation_result read(void *buffer, size_t length) { return operation_result::ok(file_->read(buffer, length)); }
 	virtual operation_result pread(void *buffer, size_t length, size_t offset) { return operation_result::ok(file_->pread(buffer, offset, length)); }
-	virtual operation_result write(const void *buffer, size_t length) { return operation_result::ok(file_->write(buffer, length)); }
-	virtual operation_result pwrite(const void *buffer, size_t length, size_t offset) { return operation_result::ok(file_->pwrite(buffer, offset, length)); }
+	virtual operation_result write(const void *buffer, size_t length)
+	{
+		u64 offset = file_->cur_offset();
+		size_t written = file_->write(buffer, length);
+
+		// Mappings of the file share its cached pages, so those have to see the write too.
+		node_->update_cache(buffer, offset, written);
+		return operation_result::ok(written);
+	}
+
+	virtual operation_result pwrite(const void *buffer, size_t length, size_t offset)
+	{
+		size_t written = file_->pwrite(buffer, offset, length);
+		node_->update_cache(buffer, offset, written);
+		return operation_result::ok(written);
+	}
+
 	virtual operation_result ioctl(u64 cmd, void *buffer, size_t length) { return operation_result::ok(file_->ioctl(cmd, buffer, length)); }
 
+	virtual operation_result mmap(mem::address_space &as, size_t offset, size_t length, bool writable) override
+	{
+		if (length == 0 || (offset & ~PAGE_MASK) || offset >= node_->size() || length > node_->size() - offset) {
+			return operation_result::invalid_argument();
+		}
+
+		auto cache = node_->cache();
+		if (!cache) {
+			return operation_result::not_supported();
+		}
+
+		mem::region_flags flags = mem::region_flags::readable;
+		if (writable) {
+			flags |= mem::region_flags::writable;
+		}
+
+		return operation_result::ok(as.map_file(*cache, offset, length, flags)->base);
+	}
+
 private:
 	shared_ptr<fs::file> file_;
+	fs::fs_node *node_;
 };
 
 class process_object : public object {
@@ -84,6 +129,17 @@ public:
 		return operation_result::ok(0);
 	}
 
+	virtual operation_result set_affinity(u64 affinity) override
+	{
+		if (!proc_->set_affinity(affinity)) {
+			return operation_result::invalid_argument();
+		}
+
+		return operation_result::ok(0);
+	}
+
+	virtual operation_result get_affinity() override { return operation_result::ok(proc_->affinity()); }
+
 private:
 	shared_ptr<sched::process> proc_;
 };
@@ -105,6 +161,41 @@ public:
 		return operation_result::ok(0);
 	}
 
+	virtual operation_result set_priority(u64 priority_class, s64 priority) override
+	{
+		sched::sched_policy policy;
+
+		switch ((thread_priority_class)priority_class) {
+		case thread_priority_class::fair:
+			policy = sched::sched_policy::fair;
+			break;
+
+		case thread_priority_class::realtime:
+			policy = sched::sched_policy::realtime;
+			break;
+
+		default:
+			return operation_result::invalid_argument();
+		}
+
+		if ((s64)(int)priority != priority || !sched::scheduler::get().set_priority(*thread_, policy, (int)priority)) {
+			return operation_result::invalid_argument();
+		}
+
+		return operation_result::ok(0);
+	}
+
+	virtual operation_result set_affinity(u64 affinity) override
+	{
+		if (!sched::scheduler::get().set_affinity(*thread_, affinity)) {
+			return operation_result::invalid_argument();
+		}
+
+		return operation_result::ok(0);
+	}
+
+	virtual operation_result get_affinity() override { return operation_result::ok(thread_->affinity()); }
+
 private:
 	shared_ptr<sched::thread> thread_;
 };
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/avl-tree.h>
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+
+namespace stacsos::kernel::sched::alg {
+
+/**
+ * A "completely fair" scheduler, which always runs the task that has had the least (virtual)
+ * runtime.  Runnable tasks are kept in a balanced tree ordered by virtual runtime, so selecting
+ * the next task is O(log n) in the number of runnable tasks.  The running task is kept out of the
+ * tree, and put back in when it is switched away from.
+ */
+class completely_fair_scheduler : public scheduling_algorithm {
+public:
+	completely_fair_scheduler()
+		: current_(nullptr)
+		, current_queued_(false)
+		, current_run_time_base_(0)
+		, min_vruntime_(0)
+	{
+	}
+
+	virtual void add_to_runqueue(tcb &tcb) override;
+	virtual void remove_from_runqueue(tcb &tcb) override;
+	virtual tcb *select_next_task(tcb *current) override;
+	virtual void put_current() override;
+	virtual tcb *select_task_to_steal(int thief_core_id) override;
+	virtual u64 time_slice(u64 quantum, u64 nr_runnable) const override;
+	virtual const char *name() const { return "completely fair"; }
+
+private:
+	struct key {
+		u64 vruntime;
+		tcb *task;
+
+		bool operator==(const key &o) const { return vruntime == o.vruntime && task == o.task; }
+		bool operator<(const key &o) const { return vruntime < o.vruntime || (vruntime == o.vruntime && (uintptr_t)task < (uintptr_t)o.task); }
+	};
+
+	avl_tree<key, tcb *> timeline_;
+
+	tcb *current_;
+	bool current_queued_;
+	u64 current_run_time_base_;
+
+	u64 min_vruntime_;
+
+	void enqueue(tcb &tcb);
+	void dequeue(tcb &tcb);
+	void place(tcb &tcb);
+	void update_current();
+	void update_min_vruntime();
+};
+} // namespace stacsos::kernel::sched::alg
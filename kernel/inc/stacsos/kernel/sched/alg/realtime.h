@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel::sched::alg {
+
+/**
+ * A fixed-priority scheduler for real-time tasks.  The highest priority runnable task always
+ * runs, and tasks of equal priority take turns (one time slice each).  There is a queue per
+ * priority level, and a bitmap of the non-empty queues, so selection is constant time.
+ */
+class realtime_scheduler : public scheduling_algorithm {
+public:
+	static const int nr_priorities = 32;
+
+	realtime_scheduler()
+		: active_(0)
+	{
+	}
+
+	virtual void add_to_runqueue(tcb &tcb) override;
+	virtual void remove_from_runqueue(tcb &tcb) override;
+	virtual tcb *select_next_task(tcb *current) override;
+	virtual tcb *select_task_to_steal(int thief_core_id) override;
+	virtual const char *name() const { return "realtime"; }
+
+	bool empty() const { return active_ == 0; }
+
+	// Returns true if there's a runnable task that should be running instead of the given one.
+	bool should_preempt(const tcb *current) const;
+
+private:
+	list<tcb *> queues_[nr_priorities];
+	u32 active_;
+
+	int highest_priority() const { return 31 - __builtin_clz(active_); }
+};
+} // namespace stacsos::kernel::sched::alg
@@ -17,6 +17,19 @@ public:
 	virtual void add_to_runqueue(tcb &tcb) = 0;
 	virtual void remove_from_runqueue(tcb &tcb) = 0;
 	virtual tcb *select_next_task(tcb *current) = 0;
+
+	// Called when a task from another scheduling class is about to run instead of the task
+	// this algorithm last selected.
+	virtual void put_current() { }
+
+	// Returns a task on the runqueue that the given core may take, or nullptr if there
+	// isn't one.  A task that is live on a core (i.e. its stack is in use), or that isn't
+	// allowed to run on the thief, must never be returned.
+	virtual tcb *select_task_to_steal(int thief_core_id) { return nullptr; }
+
+	// Returns how long (in the same units as the quantum) the task that has just been selected
+	// may run before it is preempted, given the number of runnable tasks on this core.
+	virtual u64 time_slice(u64 quantum, u64 nr_runnable) const { return quantum; }
 	virtual const char *name() const = 0;
 };
 } // namespace stacsos::kernel::sched::alg
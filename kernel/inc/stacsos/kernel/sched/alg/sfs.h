@@ -17,6 +17,7 @@ public:
 	virtual void add_to_runqueue(tcb &tcb) override { runqueue_.append(&tcb); }
 	virtual void remove_from_runqueue(tcb &tcb) override { runqueue_.remove(&tcb); }
 	virtual tcb *select_next_task(tcb *current) override;
+	virtual tcb *select_task_to_steal(int thief_core_id) override;
 	virtual const char *name() const { return "simple fair"; }
 
 private:
@@ -7,13 +7,27 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/sched/process.h>
 #include <stacsos/list.h>
 #include <stacsos/memory.h>
 
+namespace stacsos::kernel::fs {
+class fs_node;
+}
+
 namespace stacsos::kernel::sched {
 typedef void (*continuation_fn)(void);
 
+/**
+ * A pristine, loaded, process image for a binary, from which new processes are cloned.
+ */
+struct process_template {
+	fs::fs_node *binary;
+	mem::address_space *image;
+	u64 entry_point;
+};
+
 class process_manager {
 	friend class process;
 
@@ -29,8 +43,16 @@ public:
 
 	shared_ptr<process> kernel_process() const { return kernel_process_; }
 
+	bool reap_terminated_process();
+
 private:
 	shared_ptr<process> kernel_process_;
+
+	spinlock_irq lock_;
 	list<shared_ptr<process>> active_processes_;
+	list<process_template> templates_;
+
+	mem::address_space *load_image(fs::fs_node &binary, u64 &entry_point);
+	mem::address_space *instantiate_image(fs::fs_node &binary, u64 &entry_point);
 };
 } // namespace stacsos::kernel::sched
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/address-space.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/sched/event.h>
@@ -25,11 +26,20 @@ class process {
 	friend class thread;
 
 public:
+	// Where regions allocated from a user address space (e.g. with alloc_mem) start.
+	static const u64 user_region_base = 0x7fff'2000'0000;
+
 	process(exec_privilege priv)
+		: process(priv, mem::memory_manager::get().root_address_space().create_linked(user_region_base))
+	{
+	}
+
+	process(exec_privilege priv, mem::address_space *vma)
 		: priv_(priv)
 		, state_(process_state::created)
-		, vma_(mem::memory_manager::get().root_address_space().create_linked(0x7fff'2000'0000))
+		, vma_(vma)
 		, next_user_stack_(0x7fff'1000'0000)
+		, affinity_(schedulable_entity::all_cores)
 	{
 	}
 
@@ -44,16 +54,26 @@ public:
 
 	mem::address_space &addrspace() const { return *vma_; }
 
+	bool can_release_memory();
+	mem::address_space *claim_memory();
+
 	auto_reset_event &state_changed_event() { return state_changed_event_; }
 
+	// The set of cores that new threads of this process may run on.
+	u64 affinity() const { return affinity_; }
+	bool set_affinity(u64 affinity);
+
 private:
 	exec_privilege priv_;
 	process_state state_;
 	auto_reset_event state_changed_event_;
 
 	mem::address_space *vma_;
+
+	spinlock_irq threads_lock_;
 	list<shared_ptr<thread>> threads_;
 	u64 next_user_stack_;
+	u64 affinity_;
 
 	void on_thread_stopped(thread &thread);
 };
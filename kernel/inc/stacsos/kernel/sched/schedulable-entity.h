@@ -17,6 +17,9 @@ class core;
 namespace stacsos::kernel::sched {
 class schedulable_entity;
 
+// Real-time tasks always run in preference to fair-share tasks.
+enum class sched_policy { fair, realtime };
+
 struct tcb {
 	schedulable_entity *entity; // 0
 	stacsos::kernel::arch::x86::machine_context *mcontext; // 8
@@ -26,12 +29,32 @@ struct tcb {
 	u64 start_time;	// 28
 	u64 stop_time;	// 30
 	u64 run_time;	// 38
+	u64 live; // 40 - non-zero while a core is executing on this task's stack
+	tcb *prev; // 48 - the task that was switched away from to activate this one
+	u64 vruntime; // 50 - weighted runtime, used by the fair scheduling algorithms
+	s64 vlag; // 58 - distance from the runqueue's minimum vruntime when last dequeued
 } __packed;
 
 class schedulable_entity {
 public:
+	// The range of priorities for fair-share tasks.  Like UNIX nice values, lower numbers get a
+	// larger share of the processor.
+	static const int min_fair_priority = -20;
+	static const int max_fair_priority = 19;
+
+	// The weight of a fair-share task at the default priority.
+	static const u64 default_weight = 1024;
+
+	// An affinity mask that allows every core.
+	static const u64 all_cores = ~0ull;
+
 	schedulable_entity()
 		: owning_core_(nullptr)
+		, on_runqueue_(false)
+		, policy_(sched_policy::fair)
+		, priority_(0)
+		, weight_(default_weight)
+		, affinity_(all_cores)
 	{
 		memops::bzero(&tcb_, sizeof(tcb_));
 	}
@@ -39,8 +62,40 @@ public:
 	const tcb *get_tcb() const { return &tcb_; }
 	tcb *get_tcb() { return &tcb_; }
 
+	// The core whose runqueue this entity is on, or was last on.  This is only
+	// changed while holding that core's runqueue lock.
+	arch::core *owning_core() const { return owning_core_; }
+	void set_owning_core(arch::core *c) { owning_core_ = c; }
+
+	bool on_runqueue() const { return on_runqueue_; }
+	void set_on_runqueue(bool v) { on_runqueue_ = v; }
+
+	sched_policy policy() const { return policy_; }
+	int priority() const { return priority_; }
+
+	// The relative share of the processor that a fair-share task should get.
+	u64 weight() const { return weight_; }
+
+	// Changes the policy and priority, which must be valid for the policy.  This must not be
+	// called while the entity is on a runqueue; see scheduler::set_priority.
+	void set_priority(sched_policy policy, int priority);
+
+	static bool is_valid_priority(sched_policy policy, int priority);
+
+	// The set of cores (bit n for core n) that this entity may run on.  Changing this for an
+	// entity that may be on a runqueue must go through scheduler::set_affinity.
+	u64 affinity() const { return affinity_; }
+	void set_affinity(u64 affinity) { affinity_ = affinity; }
+	bool can_run_on(int core_id) const { return (affinity_ & (1ull << core_id)) != 0; }
+
 private:
 	arch::core *owning_core_;
+	bool on_runqueue_;
+
+	sched_policy policy_;
+	int priority_;
+	u64 weight_;
+	u64 affinity_;
 
 protected:
 	__aligned(16) tcb tcb_;
@@ -7,8 +7,13 @@
  */
 #pragma once
 
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+namespace stacsos::kernel::arch {
+class core;
+}
+
 namespace stacsos::kernel::sched {
-class schedulable_entity;
 
 class scheduler {
 	DEFINE_SINGLETON(scheduler);
@@ -19,5 +24,10 @@ private:
 public:
 	void add_to_schedule(schedulable_entity &e);
 	void remove_from_schedule(schedulable_entity &e);
+	bool set_priority(schedulable_entity &e, sched_policy policy, int priority);
+	bool set_affinity(schedulable_entity &e, u64 affinity);
+
+	arch::core &select_core(schedulable_entity &e);
+	u64 online_cores() const;
 };
 } // namespace stacsos::kernel::sched
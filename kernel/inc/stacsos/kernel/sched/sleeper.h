@@ -7,7 +7,9 @@
  */
 #pragma once
 
-#include <stacsos/list.h>
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/priority-queue.h>
 
 namespace stacsos::kernel::sched {
 class thread;
@@ -15,19 +17,35 @@ class thread;
 struct sleeping_thread {
 	thread *thr;
 	u64 wakeup_deadline;
+
+	bool operator<(const sleeping_thread &o) const { return wakeup_deadline < o.wakeup_deadline; }
 };
 
 class sleeper {
 	DEFINE_SINGLETON(sleeper)
 
 public:
+	static const u64 no_deadline = ~0ull;
+
 	void sleep_ms(u64 duration_ms);
-	void check_wakeup();
+
+	// Wakes any threads on this core whose deadline has passed, and returns true if there were any.
+	bool check_wakeup();
+
+	// Returns the earliest wakeup deadline (in TSC ticks) on this core, or no_deadline.
+	u64 next_deadline();
 
 private:
 	sleeper() { }
 
-	list<sleeping_thread *> sleeping_;
+	// Each core has its own deadline-ordered queue of sleeping threads, and the core's timer
+	// is programmed to fire at the earliest deadline.
+	struct sleep_queue {
+		spinlock_irq lock;
+		priority_queue<sleeping_thread> sleepers;
+	};
+
+	sleep_queue queues_[arch::core_manager::max_cores];
 
 	void do_sleep(u64 wakeup_deadline);
 };
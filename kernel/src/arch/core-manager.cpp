@@ -33,7 +33,11 @@ void core_manager::go()
 		}
 
 		dprintf("starting core %d...\n", cores_[i]->id_);
-		//cores_[i]->status_ = cores_[i]->remote_run() ? core_status::online : core_status::error;
+		cores_[i]->status_ = cores_[i]->remote_run() ? core_status::online : core_status::error;
+
+		if (cores_[i]->status_ != core_status::online) {
+			dprintf("core %d failed to start\n", cores_[i]->id_);
+		}
 	}
 
 	// Start this core running
@@ -8,12 +8,16 @@
 #include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/arch/timer.h>
+#include <stacsos/kernel/arch/x86/cpuid.h>
 #include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/irq-flags.h>
 #include <stacsos/kernel/arch/x86/machine-context.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/sched/process-manager.h>
 #include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/scheduler.h>
 
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
@@ -29,10 +33,67 @@ core &core::this_core()
 	return c;
 }
 
-static void idle_thread()
+void core::idle_thread() { core::this_core().idle(); }
+
+/**
+ * The body of the idle thread.  Waits (in the configured way) until there's something on the
+ * runqueue, and then yields to it.
+ */
+void core::idle()
 {
 	while (true) {
-		__relax();
+		// Make ourselves useful before going to sleep, but get out of the way as soon as there's
+		// real work to do.
+		while (nr_runnable() == 0 && (memory_manager::get().do_idle_work() || process_manager::get().reap_terminated_process())) {
+		}
+
+		switch (idle_mode_) {
+		case idle_mode::poll:
+			__relax();
+			break;
+
+		case idle_mode::halt:
+			// Interrupts are enabled, so this will wake up on the next interrupt, e.g. a reschedule
+			// IPI from a core that has placed a task here.
+			asm volatile("hlt");
+			break;
+
+		case idle_mode::mwait:
+			// Any write to the runqueue count (e.g. a task being placed here by another core)
+			// will end the wait, as will any interrupt.
+			asm volatile("monitor" ::"a"(&nr_runnable_), "c"(0), "d"(0));
+			if (nr_runnable() == 0) {
+				asm volatile("mwait" ::"a"(0), "c"(0));
+			}
+			break;
+		}
+
+		if (nr_runnable() > 0 || *(volatile u64 *)&nr_evicted_ > 0) {
+			asm volatile("int $0xff");
+		}
+	}
+}
+
+/**
+ * Chooses how this core should idle, from the "idle" option (poll, hlt or mwait).  By default,
+ * MWAIT is used if the processor supports it, otherwise HLT.
+ */
+void core::select_idle_mode()
+{
+	cpuid c;
+	c.initialise();
+
+	bool have_mwait = c.get_feature(cpuid_features::monitor);
+
+	const char *mode = config::get().get_option_or_default("idle", "");
+	if (memops::strcmp(mode, "poll") == 0) {
+		idle_mode_ = idle_mode::poll;
+	} else if (memops::strcmp(mode, "hlt") == 0) {
+		idle_mode_ = idle_mode::halt;
+	} else if (memops::strcmp(mode, "mwait") == 0 || *mode == 0) {
+		idle_mode_ = have_mwait ? idle_mode::mwait : idle_mode::halt;
+	} else {
+		panic("Unsupported idle mode '%s'", mode);
 	}
 }
 
@@ -60,17 +121,300 @@ void core::run()
 	idle_thread_.kernel_stack = (u64)idle_thread_stack + PAGE_SIZE;
 
 	set_current_tcb(&idle_thread_);
+	select_idle_mode();
+
+	// The scheduling quantum is given in milliseconds.
+	u64 quantum_ms = config::get().get_option_u64("quantum", 10);
+	if (quantum_ms == 0) {
+		panic("The scheduling quantum must be non-zero");
+	}
+
+	quantum_ = (clock_frequency() * quantum_ms) / 1000;
 
 	dprintf("core [%d]: run\n", id());
 	local_timer().start(100); // 100 Hz
 
+	// We start off idle, so there's no need for the tick yet.
+	local_timer().set_tick(false);
+
 	// This will also enable interrupts, because the IF flag is set in rflags.
 	x86_return_to_task();
 	__unreachable();
 }
 
+void core::add_to_runqueue(tcb &tcb)
+{
+	u64 flags;
+	rq_lock_.lock(&flags);
+
+	tcb.entity->set_owning_core(this);
+
+	// A task that is still live here must come back to this core, even if its affinity no longer
+	// allows it.  Treat it as evicted, so that it is moved on once this core has left its stack.
+	if (!tcb.entity->can_run_on(id_)) {
+		evicted_.append(&tcb);
+		nr_evicted_++;
+
+		rq_lock_.unlock(flags);
+
+		send_ipi(ipi_kind::reschedule);
+		return;
+	}
+
+	algorithm_for(tcb).add_to_runqueue(tcb);
+	tcb.entity->set_on_runqueue(true);
+	nr_runnable_++;
+
+	u64 nr_runnable = nr_runnable_;
+	bool preempt = should_preempt_for(tcb);
+
+	rq_lock_.unlock(flags);
+
+	// Let this core know straight away if the new task should run now.  Otherwise, if there's now
+	// more work here than can run at once, get an idle core to come and take some.
+	if (preempt) {
+		send_ipi(ipi_kind::reschedule);
+	} else if (nr_runnable > 1) {
+		kick_idle_core(tcb);
+	}
+}
+
+/**
+ * Returns true if the given task, which has just been placed on this core's runqueue, should
+ * preempt whatever this core is running.
+ */
+bool core::should_preempt_for(const tcb &tcb) const
+{
+	if (running_idle_) {
+		// A core waiting in MWAIT is woken by the runqueue update itself.
+		return idle_mode_ != idle_mode::mwait;
+	}
+
+	return tcb.entity->policy() == sched_policy::realtime && tcb.entity->priority() > running_rt_priority_;
+}
+
+/**
+ * Asks an idle core that the given task may run on to reschedule, so that it steals work from
+ * a busy core.
+ */
+void core::kick_idle_core(const tcb &tcb)
+{
+	for (auto *c : core_manager::get().cores()) {
+		if (c != this && c->is_online() && c->running_idle_ && tcb.entity->can_run_on(c->id())) {
+			c->send_ipi(ipi_kind::reschedule);
+			return;
+		}
+	}
+}
+
+/**
+ * Removes the given task from this core's runqueue.  Returns false if the task is owned
+ * by a different core (i.e. it has been migrated), in which case the caller should try
+ * again with the new owner.
+ */
+bool core::remove_from_runqueue(tcb &tcb)
+{
+	unique_irq_lock l(rq_lock_);
+
+	if (tcb.entity->owning_core() != this) {
+		return false;
+	}
+
+	if (tcb.entity->on_runqueue()) {
+		algorithm_for(tcb).remove_from_runqueue(tcb);
+		tcb.entity->set_on_runqueue(false);
+		nr_runnable_--;
+	} else {
+		cancel_eviction(tcb);
+	}
+
+	return true;
+}
+
+/**
+ * Changes the scheduling policy and priority of a task, moving it between scheduling algorithms
+ * if it's on this core's runqueue.  Returns false if the task is owned by a different core, in
+ * the same way as remove_from_runqueue.
+ */
+bool core::set_task_priority(tcb &tcb, sched_policy policy, int priority)
+{
+	unique_irq_lock l(rq_lock_);
+
+	if (tcb.entity->owning_core() != this) {
+		return false;
+	}
+
+	if (tcb.entity->on_runqueue()) {
+		algorithm_for(tcb).remove_from_runqueue(tcb);
+		tcb.entity->set_priority(policy, priority);
+		algorithm_for(tcb).add_to_runqueue(tcb);
+	} else {
+		tcb.entity->set_priority(policy, priority);
+	}
+
+	return true;
+}
+
+/**
+ * Changes the set of cores that a task may run on.  If the task is on this core's runqueue but
+ * may no longer run here, it is taken off the runqueue, and moved to another core by this core
+ * once it isn't live.  Returns false if the task is owned by a different core, in the same way
+ * as remove_from_runqueue.
+ */
+bool core::set_task_affinity(tcb &tcb, u64 affinity)
+{
+	u64 flags;
+	rq_lock_.lock(&flags);
+
+	if (tcb.entity->owning_core() != this) {
+		rq_lock_.unlock(flags);
+		return false;
+	}
+
+	tcb.entity->set_affinity(affinity);
+
+	bool evicted = false;
+	if (tcb.entity->on_runqueue() && !tcb.entity->can_run_on(id_)) {
+		algorithm_for(tcb).remove_from_runqueue(tcb);
+		tcb.entity->set_on_runqueue(false);
+		nr_runnable_--;
+
+		evicted_.append(&tcb);
+		nr_evicted_++;
+		evicted = true;
+	}
+
+	rq_lock_.unlock(flags);
+
+	// Get this core to move the task on as soon as it can.
+	if (evicted) {
+		send_ipi(ipi_kind::reschedule);
+	}
+
+	return true;
+}
+
+/**
+ * Forgets about a pending move of the given task, e.g. because it has been suspended.  Returns
+ * true if the task was waiting to be moved.  The runqueue lock must be held.
+ */
+bool core::cancel_eviction(tcb &tcb)
+{
+	for (auto *evicted : evicted_) {
+		if (evicted == &tcb) {
+			evicted_.remove(&tcb);
+			nr_evicted_--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Moves tasks that have been evicted from this core (see set_task_affinity) to a core that they
+ * may run on.  A task is only moved once this core has left its stack.
+ */
+void core::push_evicted_tasks()
+{
+	while (*(volatile u64 *)&nr_evicted_ > 0) {
+		tcb *task = nullptr;
+
+		u64 flags;
+		rq_lock_.lock(&flags);
+		for (auto *evicted : evicted_) {
+			if (!evicted->live) {
+				task = evicted;
+				break;
+			}
+		}
+		rq_lock_.unlock(flags);
+
+		if (!task) {
+			return;
+		}
+
+		core &target = scheduler::get().select_core(*task->entity);
+
+		if (&target == this) {
+			// The affinity has changed again, and allows this core after all.
+			rq_lock_.lock(&flags);
+			if (cancel_eviction(*task)) {
+				algorithm_for(*task).add_to_runqueue(*task);
+				task->entity->set_on_runqueue(true);
+				nr_runnable_++;
+			}
+			rq_lock_.unlock(flags);
+
+			continue;
+		}
+
+		// Take the runqueue locks in core id order, as in steal_task.
+		core &first = id_ < target.id_ ? *this : target;
+		core &second = id_ < target.id_ ? target : *this;
+
+		u64 first_flags, second_flags;
+		first.rq_lock_.lock(&first_flags);
+		second.rq_lock_.lock(&second_flags);
+
+		// The task may have been suspended while no locks were held.
+		bool moved = cancel_eviction(*task);
+		if (moved) {
+			target.algorithm_for(*task).add_to_runqueue(*task);
+			task->entity->set_owning_core(&target);
+			task->entity->set_on_runqueue(true);
+			target.nr_runnable_++;
+		}
+
+		bool preempt = moved && target.should_preempt_for(*task);
+
+		second.rq_lock_.unlock(second_flags);
+		first.rq_lock_.unlock(first_flags);
+
+		if (preempt) {
+			target.send_ipi(ipi_kind::reschedule);
+		}
+	}
+}
+
+alg::scheduling_algorithm &core::algorithm_for(const tcb &tcb)
+{
+	if (tcb.entity->policy() == sched_policy::realtime) {
+		return rt_sched_alg_;
+	}
+
+	return *sched_alg_;
+}
+
+/**
+ * Selects the next task to run from this core's runqueue, and works out how long it may run for.
+ * Real-time tasks always take precedence over fair-share ones.  The runqueue lock must be held.
+ */
+tcb *core::pick_next_task(tcb *current)
+{
+	alg::scheduling_algorithm *alg = &rt_sched_alg_;
+
+	tcb *next = rt_sched_alg_.select_next_task(current);
+	if (next) {
+		// The fair-share algorithm's task (if any) is being preempted.
+		sched_alg_->put_current();
+	} else {
+		alg = sched_alg_;
+		next = sched_alg_->select_next_task(current);
+	}
+
+	if (next) {
+		next->live = 1;
+	}
+
+	slice_length_ = alg->time_slice(quantum_, nr_runnable_);
+	return next;
+}
+
 void core::schedule()
 {
+	push_evicted_tasks();
+
 	tcb *current = get_current_tcb();
 	u64 now = __builtin_ia32_rdtsc();
 
@@ -80,20 +424,190 @@ void core::schedule()
 		current->run_time += delta;
 	}
 
-	// Select the next task for execution
-	// TODO: Check task quantum expiry
-	tcb *next = sched_alg_->select_next_task(current);
+	// Select the next task for execution.
+	u64 flags;
+	rq_lock_.lock(&flags);
+	tcb *next = pick_next_task(current);
+	rq_lock_.unlock(flags);
+
+	// If there's nothing to do here, try to take some work from a busier core.
+	if (!next) {
+		next = steal_task(current);
+	}
+
 	if (!next) {
 		next = &idle_thread_;
 	}
 
 	// Update the next task's start time
 	next->start_time = now;
+	slice_start_ = now;
+
+	// If the same task has been selected again, there's nothing to switch.
+	if (next == current) {
+		return;
+	}
+
+	// The previous task remains live until the trap return path has left its stack.
+	next->prev = current;
+
+	if (current) {
+		current->stop_time = now;
+	}
+
+	running_idle_ = next == &idle_thread_;
+	running_rt_priority_ = (next->entity && next->entity->policy() == sched_policy::realtime) ? next->entity->priority() : -1;
+
+	// An idle core only needs the timer for sleep deadlines, as other cores send it an IPI
+	// when they place work here.
+	local_timer().set_tick(!running_idle_);
 
 	// Activate the task.
 	set_current_tcb(next);
 }
 
+/**
+ * Called from the timer on each scheduler tick, when a sleeping thread is woken, or when another
+ * core asks this one to reschedule.  The running task is only preempted once it has used up its
+ * time slice, unless it is no longer runnable, a real-time task should run instead, or the core
+ * is idle.
+ */
+void core::tick()
+{
+	tcb *current = get_current_tcb();
+
+	if (current && current != &idle_thread_ && current->entity->on_runqueue() && !rt_sched_alg_.should_preempt(current)) {
+		u64 now = __builtin_ia32_rdtsc();
+		if (now - slice_start_ < slice_length_) {
+			return;
+		}
+	}
+
+	schedule();
+}
+
+/**
+ * Looks for the busiest online core, and moves a task that isn't running from its runqueue to
+ * this one.  Returns the (now live) task to run next, or nullptr if nothing was taken.
+ */
+tcb *core::steal_task(tcb *current)
+{
+	core *victim = nullptr;
+
+	for (auto *c : core_manager::get().cores()) {
+		if (c == this || !c->is_online()) {
+			continue;
+		}
+
+		// A core with a single task is most likely running it, so leave it alone.
+		if (c->nr_runnable() > 1 && (victim == nullptr || c->nr_runnable() > victim->nr_runnable())) {
+			victim = c;
+		}
+	}
+
+	if (!victim) {
+		return nullptr;
+	}
+
+	// Always take the runqueue locks in core id order, so that two cores stealing from each
+	// other can't deadlock.
+	core &first = id_ < victim->id_ ? *this : *victim;
+	core &second = id_ < victim->id_ ? *victim : *this;
+
+	u64 first_flags, second_flags;
+	first.rq_lock_.lock(&first_flags);
+	second.rq_lock_.lock(&second_flags);
+
+	tcb *next = nullptr;
+
+	tcb *stolen = victim->rt_sched_alg_.select_task_to_steal(id_);
+	if (!stolen) {
+		stolen = victim->sched_alg_->select_task_to_steal(id_);
+	}
+
+	if (stolen) {
+		migrate_task(*victim, *stolen);
+
+		// Let the algorithm select it, so that it knows it's running.
+		next = pick_next_task(current);
+	}
+
+	second.rq_lock_.unlock(second_flags);
+	first.rq_lock_.unlock(first_flags);
+
+	return next;
+}
+
+/**
+ * Moves a task from another core's runqueue to this one.  Both runqueue locks must be held.
+ */
+void core::migrate_task(core &from, tcb &tcb)
+{
+	from.algorithm_for(tcb).remove_from_runqueue(tcb);
+	from.nr_runnable_--;
+
+	algorithm_for(tcb).add_to_runqueue(tcb);
+	tcb.entity->set_owning_core(this);
+	nr_runnable_++;
+}
+
+/**
+ * Runs the given function on this core, waiting until it has completed.  The function runs in
+ * interrupt context.  The caller must not hold any lock that this core might be spinning on with
+ * interrupts disabled.
+ */
+void core::call(cross_call_fn fn, void *arg)
+{
+	if (this == &core::this_core()) {
+		u64 flags = local_irq_save();
+		fn(arg);
+		local_irq_restore(flags);
+		return;
+	}
+
+	cross_call request { fn, arg, false };
+
+	u64 flags;
+	calls_lock_.lock(&flags);
+	calls_.append(&request);
+	calls_lock_.unlock(flags);
+
+	send_ipi(ipi_kind::call_function);
+
+	// The target might be calling us at the same time (possibly with interrupts disabled), so keep
+	// running any calls made to this core while waiting.
+	auto &self = core::this_core();
+	while (!request.done) {
+		self.run_pending_calls();
+		__relax();
+	}
+}
+
+/**
+ * Runs the functions that other cores have asked this core to call.
+ */
+void core::run_pending_calls()
+{
+	while (true) {
+		cross_call *request = nullptr;
+
+		u64 flags;
+		calls_lock_.lock(&flags);
+		if (!calls_.empty()) {
+			request = calls_.dequeue();
+		}
+		calls_lock_.unlock(flags);
+
+		if (!request) {
+			return;
+		}
+
+		request->fn(request->arg);
+
+		__atomic_store_n(&request->done, true, __ATOMIC_RELEASE);
+	}
+}
+
 void core::update_clock()
 {
 	// Update the internal clock
@@ -19,12 +19,112 @@ using namespace stacsos::kernel::sched;
 void x2apic_timer::timer_irq_handler(u8 irq, void *context, void *arg)
 {
 	x2apic_timer *timer = (x2apic_timer *)arg;
-	timer->lapic_.owner().update_clock();
+	auto &owner = timer->lapic_.owner();
 
-	sleeper::get().check_wakeup();
+	owner.update_clock();
 
-	timer->lapic_.owner().schedule();
+	// Give newly woken threads the chance to run straight away.
+	bool reschedule = sleeper::get().check_wakeup();
+
+	u64 now = owner.local_tsc().read();
+	if (timer->tick_enabled_ && now >= timer->next_tick_) {
+		// Don't try to catch up on ticks that were missed.
+		timer->next_tick_ = now + timer->tick_period_;
+		reschedule = true;
+	}
+
+	if (reschedule) {
+		owner.tick();
+	}
+
+	timer->rearm();
 	timer->lapic_.eoi();
 }
 
 void x2apic_timer::init() { lapic_.set_timer_irq(lapic_.owner().irqmgr().allocate_irq(timer_irq_handler, this)); }
+
+void x2apic_timer::start(u64 frequency)
+{
+	auto &tsc = lapic_.owner().local_tsc();
+
+	tick_period_ = tsc.frequency() / frequency;
+	next_tick_ = tsc.read() + tick_period_;
+
+	lapic_.set_timer_one_shot();
+	lapic_.set_timer_divide(3);
+
+	running_ = true;
+	rearm();
+
+	lapic_.unmask_interrupts(x2apic_lvts::timer);
+}
+
+void x2apic_timer::stop()
+{
+	running_ = false;
+
+	lapic_.mask_interrupts(x2apic_lvts::timer);
+	lapic_.set_timer_initial_count(0);
+}
+
+void x2apic_timer::rearm()
+{
+	if (!running_) {
+		return;
+	}
+
+	u64 deadline = sleeper::get().next_deadline();
+	if (tick_enabled_) {
+		deadline = min(next_tick_, deadline);
+	}
+
+	if (deadline == sleeper::no_deadline) {
+		// Nothing to wait for, so don't fire at all.
+		lapic_.set_timer_initial_count(0);
+		return;
+	}
+
+	program(deadline);
+}
+
+void x2apic_timer::set_tick(bool enabled)
+{
+	if (tick_enabled_ == enabled) {
+		return;
+	}
+
+	tick_enabled_ = enabled;
+
+	// A task coming off idle gets a full tick before it can be preempted.
+	if (enabled) {
+		next_tick_ = lapic_.owner().local_tsc().read() + tick_period_;
+	}
+
+	rearm();
+}
+
+/**
+ * Programs the timer to fire at the given TSC deadline.
+ */
+void x2apic_timer::program(u64 deadline)
+{
+	auto &tsc = lapic_.owner().local_tsc();
+
+	u64 now = tsc.read();
+	u64 delta = deadline > now ? deadline - now : 0;
+
+	// Keep far-off deadlines in range of the 32-bit counter (and of the conversion below).  The
+	// timer will just be re-armed when it fires early.
+	if (delta > tsc.frequency()) {
+		delta = tsc.frequency();
+	}
+
+	// Convert from TSC ticks to timer ticks (the timer is divided by 16).  A count of zero would
+	// stop the timer, so always program at least one tick.
+	u64 count = (delta * (lapic_.get_timer_frequency() >> 4)) / tsc.frequency();
+	if (count == 0) {
+		count = 1;
+	}
+
+	lapic_.set_timer_initial_count((u32)count);
+}
@@ -5,10 +5,14 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/x86/cpuid.h>
 #include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/irq-flags.h>
 #include <stacsos/kernel/arch/x86/msr.h>
 #include <stacsos/kernel/arch/x86/pit.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/sched/thread.h>
@@ -23,6 +27,11 @@ using namespace stacsos::kernel::sched;
 
 extern "C" void syscall_entry();
 
+// Inter-processor interrupt vectors.  These must be the same on every core.
+static const u8 reschedule_vector = 0xf0;
+static const u8 call_function_vector = 0xf1;
+static const u8 tlb_shootdown_vector = 0xf2;
+
 void x86_core::init()
 {
 	// Populate the descriptor tables (GDT, IDT, TSS)
@@ -31,6 +40,8 @@ void x86_core::init()
 	// Initialise the local timestamp counter
 	tsc_.calibrate();
 
+	init_pcid();
+
 	// Initialise the Local APIC, and the Local APIC timer.
 	lapic_.init();
 	timer_.init();
@@ -38,10 +49,7 @@ void x86_core::init()
 	// Create a temporary TCB so we can take the first interrupt.  This is needed
 	// because the IRQ handling code needs somewhere to store a pointer to the saved
 	// context.
-	temporary_tcb.context_ptr = 0;
-	temporary_tcb.task_ptr = 0;
-	temporary_tcb.cr3 = 0;
-	temporary_tcb.kernel_stack = 0;
+	memops::bzero(&temporary_tcb, sizeof(temporary_tcb));
 
 	// Pop a pointer to this temporary TCB into GS.  It's not a /real/ tcb structure,
 	// so we can't use set_current_tcb.
@@ -59,18 +67,245 @@ void x86_core::init()
 
 void x86_core::set_current_tcb(const stacsos::kernel::sched::tcb *tcb)
 {
-	// TODO: Check if TCB is changing...
-
 	// A pointer to the current TCB is held in the GS register.
+	if ((const stacsos::kernel::sched::tcb *)gsbase::read() == tcb) {
+		return;
+	}
+
 	gsbase::write((u64)tcb);
 
-	// Update the CR3
-	cr3::write(tcb->cr3);
+	// Threads of the same process (and all kernel threads) share page tables, in which case
+	// there's no need to touch CR3 (and so flush the TLB).
+	if (tcb->cr3 != active_cr3_) {
+		switch_address_space(tcb->cr3);
+	}
 
 	// Update the TSS
 	tss_.set_kernel_stack(tcb->kernel_stack);
 }
 
+void x86_core::send_ipi(ipi_kind kind)
+{
+	u8 vector;
+
+	switch (kind) {
+	case ipi_kind::reschedule:
+		vector = reschedule_vector;
+		break;
+	case ipi_kind::call_function:
+		vector = call_function_vector;
+		break;
+	case ipi_kind::tlb_shootdown:
+		vector = tlb_shootdown_vector;
+		break;
+	default:
+		panic("invalid ipi kind");
+	}
+
+	// The IPI is sent from the executing core's local APIC to this core.
+	x86_core::this_core().lapic().send_ipi(id(), vector);
+}
+
+void x86_core::reschedule_irq_handler(u8 irq, void *context, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+
+	c->tick();
+	c->lapic_.eoi();
+}
+
+void x86_core::call_function_irq_handler(u8 irq, void *context, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+
+	c->run_pending_calls();
+	c->lapic_.eoi();
+}
+
+void x86_core::tlb_shootdown_irq_handler(u8 irq, void *context, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+
+	c->handle_tlb_shootdown();
+	c->lapic_.eoi();
+}
+
+// The TLB shootdown currently in progress.  Only one core can be shooting down at a time.
+static struct {
+	u32 busy;
+	u64 cr3;
+	u64 address;
+	u64 nr_pages;
+	u64 pending;
+} shootdown;
+
+void x86_core::flush_tlb(u64 cr3, u64 address, u64 nr_pages)
+{
+	// Stay on this core throughout.
+	u64 flags = local_irq_save();
+
+	auto &self = x86_core::this_core();
+
+	// While waiting for our turn, keep acknowledging the shootdown in progress, because we may be
+	// one of its targets (and we can't take its IPI with interrupts disabled).
+	while (__atomic_exchange_n(&shootdown.busy, 1, __ATOMIC_ACQUIRE)) {
+		self.handle_tlb_shootdown();
+		__relax();
+	}
+
+	shootdown.cr3 = cr3;
+	shootdown.address = address;
+	shootdown.nr_pages = nr_pages;
+
+	u64 nr_targets = 0;
+	for (auto *c : core_manager::get().cores()) {
+		if (c != &self && c->is_online()) {
+			nr_targets++;
+		}
+	}
+
+	__atomic_store_n(&shootdown.pending, nr_targets, __ATOMIC_RELEASE);
+
+	for (auto *c : core_manager::get().cores()) {
+		if (c != &self && c->is_online()) {
+			x86_core *target = (x86_core *)c;
+
+			__atomic_store_n(&target->tlb_shootdown_pending_, true, __ATOMIC_RELEASE);
+			target->send_ipi(ipi_kind::tlb_shootdown);
+		}
+	}
+
+	self.flush_tlb_local(cr3, address, nr_pages);
+
+	while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) > 0) {
+		__relax();
+	}
+
+	__atomic_store_n(&shootdown.busy, 0, __ATOMIC_RELEASE);
+
+	local_irq_restore(flags);
+}
+
+bool x86_core::is_address_space_active(u64 cr3)
+{
+	for (auto *c : core_manager::get().cores()) {
+		if (__atomic_load_n(&((x86_core *)c)->active_cr3_, __ATOMIC_ACQUIRE) == cr3) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void x86_core::handle_tlb_shootdown()
+{
+	if (!__atomic_exchange_n(&tlb_shootdown_pending_, false, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	flush_tlb_local(shootdown.cr3, shootdown.address, shootdown.nr_pages);
+	__atomic_sub_fetch(&shootdown.pending, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Invalidates the TLB entries on this core for a range of pages in the given address space.
+ */
+void x86_core::flush_tlb_local(u64 cr3, u64 address, u64 nr_pages)
+{
+	// Beyond this many pages, it's cheaper to flush everything.
+	static const u64 max_single_page_flushes = 32;
+
+	bool everywhere = cr3 == all_address_spaces;
+
+	// Entries tagged with the PCID of an address space that isn't loaded can't be invalidated
+	// individually, so forget the PCID instead: the address space will be flushed when it's next
+	// loaded.
+	if (pcid_enabled_) {
+		for (int i = 0; i < nr_pcid_slots; i++) {
+			if (pcid_slots_[i] != active_cr3_ && (everywhere || pcid_slots_[i] == cr3)) {
+				pcid_slots_[i] = 0;
+			}
+		}
+	}
+
+	if (!everywhere && cr3 != active_cr3_) {
+		return;
+	}
+
+	if (nr_pages <= max_single_page_flushes) {
+		for (u64 i = 0; i < nr_pages; i++) {
+			asm volatile("invlpg (%0)" ::"r"(address + (i << PAGE_BITS)) : "memory");
+		}
+
+		return;
+	}
+
+	// Reloading CR3 without bit 63 set flushes the current PCID (or everything, without PCIDs).
+	u64 value = active_cr3_;
+	if (pcid_enabled_) {
+		for (int i = 0; i < nr_pcid_slots; i++) {
+			if (pcid_slots_[i] == active_cr3_) {
+				value |= (u64)(i + 1);
+				break;
+			}
+		}
+	}
+
+	cr3::write(value);
+}
+
+/**
+ * Enables process-context identifiers, if the processor supports them and they haven't been
+ * turned off with "pcid=no".  This must be called while CR3 holds the boot-time page tables,
+ * as PCIDE can only be set while the current PCID is zero.
+ */
+void x86_core::init_pcid()
+{
+	cpuid c;
+	c.initialise();
+
+	if (!c.get_feature(cpuid_features::pcid)) {
+		return;
+	}
+
+	if (memops::strcmp(config::get().get_option_or_default("pcid", "yes"), "no") == 0) {
+		return;
+	}
+
+	cr4::write(cr4::read() | cr4_flags::PCIDE);
+	pcid_enabled_ = true;
+}
+
+/**
+ * Loads the given page tables.  With PCIDs, an address space that has run here recently keeps
+ * its TLB entries, so only address spaces that are new to this core are flushed.
+ */
+void x86_core::switch_address_space(u64 cr3)
+{
+	active_cr3_ = cr3;
+
+	if (!pcid_enabled_) {
+		cr3::write(cr3);
+		return;
+	}
+
+	for (int i = 0; i < nr_pcid_slots; i++) {
+		if (pcid_slots_[i] == cr3) {
+			// Bit 63 preserves the TLB entries tagged with this PCID.
+			cr3::write(cr3 | (u64)(i + 1) | (1ull << 63));
+			return;
+		}
+	}
+
+	// Evict the oldest address space.  Loading CR3 without bit 63 flushes whatever was left
+	// behind under its PCID.
+	int slot = next_pcid_slot_;
+	next_pcid_slot_ = (next_pcid_slot_ + 1) % nr_pcid_slots;
+
+	pcid_slots_[slot] = cr3;
+	cr3::write(cr3 | (u64)(slot + 1));
+}
+
 stacsos::kernel::sched::tcb *x86_core::get_current_tcb() { return (stacsos::kernel::sched::tcb *)gsbase::read(); }
 
 static void yield_handler(u8 irq_nr, void *mcontext, void *arg)
@@ -100,41 +335,67 @@ void x86_core::populate_dt()
 	// The IRQ manager takes care of the IDT
 	irqs_.initialise();
 	irqs_.reserve_irq(0xff, yield_handler, this);
+	irqs_.reserve_irq(reschedule_vector, reschedule_irq_handler, this);
+	irqs_.reserve_irq(call_function_vector, call_function_irq_handler, this);
+	irqs_.reserve_irq(tlb_shootdown_vector, tlb_shootdown_irq_handler, this);
 
 	// The TSS is needed for swapping stacks if we're going into USER mode.
 	tss_.set_kernel_stack(0);
 	tss_.reload(0x28);
 }
 
-bool x86_core::remote_run() { return false; }
+// The mp startup code is copied into this page, and the two pages that follow it hold
+// the temporary page tables used to get the remote core into long mode.  This MUST agree
+// with MPSTARTUP_BASE in mpstartup.S.
+static const pfn_t mpstartup_pfn = 0x8;
+static const pfn_t mpstartup_pml4_pfn = mpstartup_pfn + 1;
+static const pfn_t mpstartup_pdp_pfn = mpstartup_pfn + 2;
+
+// The size of the stack a remote core uses until it switches to its idle thread.
+static const int mpstartup_stack_order = 1;
 
-#if 0
 struct mpstartup_data {
 	u64 mpready;
 	u64 mpcr3;
+	u64 kernel_cr3;
 	x86_core *core_obj;
 	void *mpstack;
-	void (stacsos::kernel::arch::x86::x86_core::*trampoline)(void);
+	void (*entry)(x86_core *);
 } __packed;
 
-extern "C" char _MPSTARTUP_START, _MPSTARTUP_END, _MPSTARTUP_SIZE;
+extern "C" char _MPSTARTUP_START, _MPSTARTUP_END;
 extern "C" mpstartup_data _MPSTARTUP_DATA;
 
+/**
+ * Returns a pointer to the copy of the mp startup data structure that lives in low memory, i.e.
+ * the one that the remote core actually sees.  It's volatile, so that we can check the mpready
+ * flag without worrying that the compiler optimises "redundant checks" away.
+ */
+static volatile mpstartup_data *mpstartup_data_ptr()
+{
+	u64 offset = (u64)&_MPSTARTUP_DATA - (u64)&_MPSTARTUP_START;
+	return (volatile mpstartup_data *)phys_to_virt((mpstartup_pfn << PAGE_BITS) + offset);
+}
+
 bool x86_core::remote_run()
 {
 	auto &me = this_core();
 
 	pfn_t mpstart_pfn = prepare_mpstartup_code();
 
-	// Acquire a pointer to the mp startup data structure, which we need to fill in.  It should
-	// be volatile, so that we can check the mpready flag without worrying that the compiler
-	// optimises "redundant checks" away.
-	volatile mpstartup_data *d = (volatile mpstartup_data *)&_MPSTARTUP_DATA;
+	auto stack = memory_manager::get().pgalloc().allocate_pages(mpstartup_stack_order);
+	if (stack.is_error()) {
+		dprintf("core [%d]: unable to allocate startup stack\n", id());
+		return false;
+	}
+
+	volatile mpstartup_data *d = mpstartup_data_ptr();
 	d->mpready = 0; // Is the core ready?
-	d->mpcr3 = __read_cr3(); // The pages tables to provide the core with (just the same as this core's)
+	d->mpcr3 = mpstartup_pml4_pfn << PAGE_BITS; // The temporary page tables, used on the way into 64-bit mode
+	d->kernel_cr3 = memory_manager::get().root_address_space().pgtable().effective_cr3(); // The real kernel page tables
 	d->core_obj = this; // A pointer to the core object that is coming online
-	d->mpstack = (void *)(((u64) new char[0x1000]) + 0x1000); // A temporary stack (which we need to remember to free at some point)
-	d->trampoline = &exegol::arch::x86::x86_core::complete_remote_init; // The function to call once we've gotten into 64-bit mode
+	d->mpstack = (void *)((u64)stack.to_page().base_address_ptr() + (PAGE_SIZE << mpstartup_stack_order)); // A temporary stack
+	d->entry = &x86_core::remote_entry; // The function to call once we've gotten into 64-bit mode
 
 	// Stick in a full memory fence, just to be safe.
 	asm volatile("mfence" ::: "memory");
@@ -149,46 +410,70 @@ bool x86_core::remote_run()
 	me.lapic_.send_remote_sipi(id(), mpstart_pfn);
 	me.tsc_.spin(1); // Wait for 1ms...
 
-	// If the core didn't come online, send another SIPI and give it a second
+	// If the core didn't start, send another SIPI.  A core that has already started ignores it.
 	if (!d->mpready) {
 		me.lapic_.send_remote_sipi(id(), mpstart_pfn);
-		me.tsc_.spin(1000); // 1s
 	}
 
-	// Return whether or not the core came online.
-	return !!d->mpready;
+	// Give the core a second to finish initialising.  We wait for it to complete, rather than just
+	// to start, because initialisation uses shared hardware (e.g. the PIT for calibration) and the
+	// startup page is reused for the next core.
+	u64 deadline = me.tsc_.read() + me.tsc_.frequency();
+	while (!d->mpready && me.tsc_.read() < deadline) {
+		__relax();
+	}
+
+	if (!d->mpready) {
+		// The core never used the stack, so we can have it back.
+		memory_manager::get().pgalloc().free_pages(stack.get_range_start(), mpstartup_stack_order);
+		return false;
+	}
+
+	return true;
 }
 
 pfn_t x86_core::prepare_mpstartup_code()
 {
-	// This function is a total hack.  It just brutally copies the mp startup code and data into an arbitrary page,
-	// because we can only access PFNs < 0x100 when initialising other processors.
+	// The SIPI vector can only address pages below 1M, so the startup code must be copied
+	// into one of them.  This region is never handed to the page allocator.
+	size_t size = (size_t)(&_MPSTARTUP_END - &_MPSTARTUP_START);
+	assert(size <= PAGE_SIZE);
+
+	memops::memcpy(phys_to_virt(mpstartup_pfn << PAGE_BITS), (void *)&_MPSTARTUP_START, size);
 
-	pfn_t target_pfn = 0; // Let's go for page 0.  The mp startup assembly is written to
-						  // work in page 0 -- there is one place where a relative address
-						  // computation is made, which assumes we're running in page zero.
+	// Build the temporary page tables.  The lower half of the address space is identity mapped (with
+	// a single 1G page), so the trampoline keeps running when paging is switched on, and the upper half
+	// is shared with the kernel, so it can jump into the kernel proper.
+	u64 *pml4 = (u64 *)phys_to_virt(mpstartup_pml4_pfn << PAGE_BITS);
+	u64 *pdp = (u64 *)phys_to_virt(mpstartup_pdp_pfn << PAGE_BITS);
+	const u64 *kernel_pml4 = (const u64 *)phys_to_virt(memory_manager::get().root_address_space().pgtable().effective_cr3());
 
-	// Copy the mp startup assembly into the right place.  Technically, we only need the 16-bit
-	// code, because once we jump into 32-bit mode, we're actually executing at normal addresses.
-	void *target_addr = (void *)(target_pfn << PAGE_BITS);
-	memops::memcpy(target_addr, (void *)&_MPSTARTUP_START, (size_t)&_MPSTARTUP_SIZE);
+	memops::pzero(pdp, 1);
+	pdp[0] = 0x83; // 0 -> 0, 1G, PRESENT | WRITABLE
 
-	// We really need to remember to unmap page zero later...
-	return target_pfn;
+	memops::memcpy(pml4, kernel_pml4, PAGE_SIZE);
+	pml4[0] = (mpstartup_pdp_pfn << PAGE_BITS) | 3; // PRESENT | WRITABLE
+
+	return mpstartup_pfn;
 }
 
+void x86_core::remote_entry(x86_core *core) { core->complete_remote_init(); }
+
 void x86_core::complete_remote_init()
 {
-	// Update the TSC aux MSR with the core ID, so that the rdpid instruction works.
-	msr::write(msr_indicies::IA32_TSC_AUX, id());
+	// Update the TSC aux MSR with the core ID, so that this_core_id() works.
+	msrs::ia32_tsc_aux = id();
 
 	dprintf("core [%d] online\n", id());
 
-	// Initialise and run this new core.
+	// Initialise this new core, and let the bootstrap core know it can carry on.
 	init();
+
+	asm volatile("mfence" ::: "memory");
+	mpstartup_data_ptr()->mpready = 1;
+
 	run();
 }
-#endif
 
 void x86_core::handle_gpf(machine_context *mc)
 {
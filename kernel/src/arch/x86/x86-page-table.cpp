@@ -22,6 +22,35 @@ static u64 l1_pg_off(u64 address) { return address & 0xfff; } // 4K
 static u64 l2_pg_off(u64 address) { return address & 0x1fffff; } // 2M
 static u64 l3_pg_off(u64 address) { return address & 0x3fffffff; } // 1G
 
+static mapping_flags entry_flags(const base_entry &e)
+{
+	mapping_flags flags = mapping_flags::present;
+	if (e.rw()) {
+		flags |= mapping_flags::writable;
+	}
+
+	if (e.us()) {
+		flags |= mapping_flags::user_accessable;
+	}
+
+	return flags;
+}
+
+/**
+ * The permissions of an intermediate entry apply to everything below it, so they must be at least as
+ * permissive as the most permissive mapping underneath.
+ */
+static void widen_permissions(base_entry &e, bool rw, bool user)
+{
+	if (rw) {
+		e.rw(true);
+	}
+
+	if (user) {
+		e.us(true);
+	}
+}
+
 x86_page_table *x86_page_table::create_empty(page_table_allocator &pta)
 {
 	page &pml4 = pta.allocate();
@@ -57,6 +86,8 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 		l4.present(true);
 		l4.rw(rw);
 		l4.us(user);
+	} else {
+		widen_permissions(l4, rw, user);
 	}
 
 	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
@@ -77,6 +108,8 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			if (l3.size()) {
 				panic("overlapping mapping");
 			}
+
+			widen_permissions(l3, rw, user);
 		} else {
 			page &l2page = pta.allocate();
 			l3.reset();
@@ -105,6 +138,8 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			if (l2.size()) {
 				panic("overlapping mapping");
 			}
+
+			widen_permissions(l2, rw, user);
 		} else {
 			page &l1page = pta.allocate();
 			l2.reset();
@@ -123,37 +158,214 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 	l1.us(user);
 }
 
+void x86_page_table::map_range(page_table_allocator &pta, u64 virtual_address, u64 physical_address, u64 nr_pages, mapping_flags flags)
+{
+	static const u64 pages_per_2m = 1 << 9;
+	static const u64 pages_per_1g = 1 << 18;
+
+	while (nr_pages > 0) {
+		u64 alignment = virtual_address | physical_address;
+
+		mapping_size size;
+		u64 step;
+		if (nr_pages >= pages_per_1g && !(alignment & (GB(1) - 1))) {
+			size = mapping_size::m1g;
+			step = pages_per_1g;
+		} else if (nr_pages >= pages_per_2m && !(alignment & (MB(2) - 1))) {
+			size = mapping_size::m2m;
+			step = pages_per_2m;
+		} else {
+			size = mapping_size::m4k;
+			step = 1;
+		}
+
+		map(pta, virtual_address, physical_address, flags, size);
+
+		virtual_address += step << PAGE_BITS;
+		physical_address += step << PAGE_BITS;
+		nr_pages -= step;
+	}
+}
+
+void x86_page_table::unmap(page_table_allocator &pta, u64 virtual_address)
+{
+	// The page tables themselves are left in place, even if they end up empty.
+
+	pml4e &l4 = pml4_[pml4_index(virtual_address)];
+	if (!l4.present()) {
+		return;
+	}
+
+	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
+	if (!l3.present()) {
+		return;
+	}
+
+	if (l3.size()) {
+		l3.reset();
+		return;
+	}
+
+	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
+	if (!l2.present()) {
+		return;
+	}
+
+	if (l2.size()) {
+		l2.reset();
+		return;
+	}
+
+	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
+	l1.reset();
+}
+
 mapping x86_page_table::get_mapping(u64 virtual_address)
 {
 	pml4e &l4 = pml4_[pml4_index(virtual_address)];
 	if (!l4.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_flags::none, mapping_size::m4k };
 	}
 
 	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
 	if (!l3.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_flags::none, mapping_size::m4k };
 	}
 
 	if (l3.size()) {
-		return { mapping_result::ok, l3.base_address() + l3_pg_off(virtual_address) };
+		return { mapping_result::ok, l3.base_address() + l3_pg_off(virtual_address), entry_flags(l3), mapping_size::m1g };
 	}
 
 	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
 	if (!l2.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_flags::none, mapping_size::m4k };
 	}
 
 	if (l2.size()) {
-		return { mapping_result::ok, l2.base_address() + l2_pg_off(virtual_address) };
+		return { mapping_result::ok, l2.base_address() + l2_pg_off(virtual_address), entry_flags(l2), mapping_size::m2m };
 	}
 
 	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
 	if (!l1.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_flags::none, mapping_size::m4k };
+	}
+
+	return { mapping_result::ok, l1.base_address() + l1_pg_off(virtual_address), entry_flags(l1), mapping_size::m4k };
+}
+
+template <typename T> static bool table_empty(const T &table)
+{
+	for (int i = 0; i < 0x200; i++) {
+		if (table[i].present()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template <typename T> static T &table_at(const base_entry &e) { return *(T *)page::get_from_base_address(e.base_address()).base_address_ptr(); }
+
+static pdpe *find_pdpe(pml4 &l4t, u64 virtual_address)
+{
+	pml4e &l4 = l4t[pml4_index(virtual_address)];
+	if (!l4.present()) {
+		return nullptr;
+	}
+
+	return &table_at<pdp>(l4)[pdp_index(virtual_address)];
+}
+
+static pde *find_pde(pml4 &l4t, u64 virtual_address)
+{
+	pdpe *l3 = find_pdpe(l4t, virtual_address);
+	if (!l3 || !l3->present() || l3->size()) {
+		return nullptr;
+	}
+
+	return &table_at<pd>(*l3)[pd_index(virtual_address)];
+}
+
+bool x86_page_table::is_unmapped(u64 virtual_address, mapping_size size)
+{
+	pdpe *l3 = find_pdpe(pml4_, virtual_address);
+	if (!l3 || !l3->present()) {
+		return true;
+	}
+
+	if (size == mapping_size::m1g || l3->size()) {
+		return false;
+	}
+
+	pde &l2 = table_at<pd>(*l3)[pd_index(virtual_address)];
+	if (!l2.present()) {
+		return true;
+	}
+
+	if (size == mapping_size::m2m || l2.size()) {
+		return false;
+	}
+
+	return !table_at<pt>(l2)[pt_index(virtual_address)].present();
+}
+
+void x86_page_table::prune(u64 virtual_address, u64 nr_pages, list<page *> &tables)
+{
+	u64 end = virtual_address + (nr_pages << PAGE_BITS);
+
+	// Work from the bottom up, so that a table emptied by detaching the tables below it goes too.
+	for (u64 va = virtual_address & ~(MB(2) - 1); va < end; va += MB(2)) {
+		pde *l2 = find_pde(pml4_, va);
+		if (l2 && l2->present() && !l2->size() && table_empty(table_at<pt>(*l2))) {
+			tables.push(&page::get_from_base_address(l2->base_address()));
+			l2->reset();
+		}
+	}
+
+	for (u64 va = virtual_address & ~(GB(1) - 1); va < end; va += GB(1)) {
+		pdpe *l3 = find_pdpe(pml4_, va);
+		if (l3 && l3->present() && !l3->size() && table_empty(table_at<pd>(*l3))) {
+			tables.push(&page::get_from_base_address(l3->base_address()));
+			l3->reset();
+		}
+	}
+
+	for (u64 va = virtual_address & ~(GB(512) - 1); va < end; va += GB(512)) {
+		pml4e &l4 = pml4_[pml4_index(va)];
+		if (pml4_index(va) < 0x100 && l4.present() && table_empty(table_at<pdp>(l4))) {
+			tables.push(&page::get_from_base_address(l4.base_address()));
+			l4.reset();
+		}
+	}
+}
+
+void x86_page_table::destroy(page_table_allocator &pta)
+{
+	for (int i = 0; i < 0x100; i++) {
+		if (!pml4_[i].present()) {
+			continue;
+		}
+
+		pdp &pdpt = table_at<pdp>(pml4_[i]);
+		for (int j = 0; j < 0x200; j++) {
+			if (!pdpt[j].present() || pdpt[j].size()) {
+				continue;
+			}
+
+			pd &pdt = table_at<pd>(pdpt[j]);
+			for (int k = 0; k < 0x200; k++) {
+				if (pdt[k].present() && !pdt[k].size()) {
+					pta.free(page::get_from_base_address(pdt[k].base_address()));
+				}
+			}
+
+			pta.free(page::get_from_base_address(pdpt[j].base_address()));
+		}
+
+		pta.free(page::get_from_base_address(pml4_[i].base_address()));
 	}
 
-	return { mapping_result::ok, l1.base_address() + l1_pg_off(virtual_address) };
+	pta.free(page::get_from_base_address(effective_cr3()));
 }
 
 void x86_page_table::dump() const
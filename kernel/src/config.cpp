@@ -47,6 +47,30 @@ void config::init(const char *cmdline)
 	add_option(kp, vp);
 }
 
+/**
+ * Returns the value of the given option, parsed as an unsigned decimal number.  If the option
+ * is missing or isn't a valid number, the default is returned.
+ */
+u64 config::get_option_u64(const char *name, u64 dfl) const
+{
+	const char *value = get_option(name);
+	if (!value || !*value) {
+		return dfl;
+	}
+
+	u64 result = 0;
+	for (const char *p = value; *p; p++) {
+		if (*p < '0' || *p > '9') {
+			dprintf("config: invalid number '%s' for option '%s'\n", value, name);
+			return dfl;
+		}
+
+		result = (result * 10) + (*p - '0');
+	}
+
+	return result;
+}
+
 void config::add_option(const char *key, const char *value)
 {
 	options_[nr_options_].key = key;
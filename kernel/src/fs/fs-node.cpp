@@ -8,6 +8,8 @@
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/fs/page-cache.h>
+#include <stacsos/kernel/fs/vfs.h>
 
 using namespace stacsos::kernel::fs;
 
@@ -51,3 +53,50 @@ fs_node *fs_node::lookup(const char *path)
 		}
 	}
 }
+
+/**
+ * Returns the page cache for this node's contents, creating (and registering with the VFS, so that
+ * its pages can be reclaimed) it the first time it is asked for.  Nodes live for as long as the
+ * system is up, and so do their caches.
+ */
+page_cache *fs_node::cache()
+{
+	{
+		unique_irq_lock l(cache_lock_);
+		if (cache_) {
+			return cache_;
+		}
+	}
+
+	// Opening the file may have to read from the disk, so it can't be done with the lock held.
+	auto f = open();
+	if (!f) {
+		return nullptr;
+	}
+
+	auto new_cache = new page_cache(*this, f);
+
+	{
+		unique_irq_lock l(cache_lock_);
+		if (cache_) {
+			delete new_cache;
+			return cache_;
+		}
+
+		cache_ = new_cache;
+	}
+
+	vfs::get().register_cache(*new_cache);
+	return new_cache;
+}
+
+/**
+ * Keeps this node's cached pages (if it has any) in step with a write to the node's contents.
+ */
+void fs_node::update_cache(const void *buffer, u64 offset, u64 length)
+{
+	unique_irq_lock l(cache_lock_);
+	if (cache_) {
+		cache_->update(buffer, offset, length);
+	}
+}
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/fs/page-cache.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/list.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::mem;
+
+/**
+ * Returns the page holding the given page of the file, reading it in if it isn't cached yet, or
+ * nullptr if the page is beyond the end of the file (or there's no memory to read it into).  The
+ * cache always keeps its own reference to the page, and another is taken for the caller, which
+ * must be dropped with page::release() when it is no longer used.
+ */
+page *page_cache::get_page(u64 index)
+{
+	u64 offset = index << PAGE_BITS;
+	if (offset >= size()) {
+		return nullptr;
+	}
+
+	u64 pfn;
+	{
+		unique_irq_lock l(lock_);
+
+		if (pages_.try_get_value(index, pfn)) {
+			page &cached = page::get_from_pfn(pfn);
+			cached.acquire();
+
+			return &cached;
+		}
+	}
+
+	// Read the page in without holding the lock, as that may well have to wait for the disk.  The
+	// page is zeroed first, so that whatever lies beyond the end of the file reads as zero.
+	auto result = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero | page_allocation_flags::reclaim);
+	if (result.is_error()) {
+		return nullptr;
+	}
+
+	page &fresh = page::get_from_pfn(result.get_range_start());
+	file_->pread(fresh.base_address_ptr(), offset, min<u64>(PAGE_SIZE, size() - offset));
+
+	{
+		unique_irq_lock l(lock_);
+
+		// Someone else may have read the same page in the meantime, in which case theirs is used.
+		if (pages_.try_get_value(index, pfn)) {
+			page &cached = page::get_from_pfn(pfn);
+			cached.acquire();
+			l.unlock();
+
+			memory_manager::get().pgalloc().free_pages(fresh.pfn(), 0);
+			return &cached;
+		}
+
+		pages_.add(index, fresh.pfn());
+	}
+
+	fresh.acquire();
+	return &fresh;
+}
+
+/**
+ * Copies data that has just been written to the file into the pages of it that are cached, so that
+ * mappings of the file see the write.  Pages that aren't cached are left alone: they'll be read
+ * from the file when they are next asked for.
+ */
+void page_cache::update(const void *buffer, u64 offset, u64 length)
+{
+	unique_irq_lock l(lock_);
+
+	const u8 *src = (const u8 *)buffer;
+	u64 end = offset + length;
+
+	while (offset < end) {
+		u64 page_offset = offset & ~PAGE_MASK;
+		u64 chunk = min<u64>(PAGE_SIZE - page_offset, end - offset);
+
+		u64 pfn;
+		if (pages_.try_get_value(offset >> PAGE_BITS, pfn)) {
+			memops::memcpy((u8 *)page::get_from_pfn(pfn).base_address_ptr() + page_offset, src, chunk);
+		}
+
+		src += chunk;
+		offset += chunk;
+	}
+}
+
+/**
+ * Drops the cached pages that nothing has mapped (i.e. that only the cache holds a reference to),
+ * giving them back to the page allocator.  Returns the number of pages released.
+ */
+u64 page_cache::release_unused_pages()
+{
+	unique_irq_lock l(lock_);
+
+	// References are only ever taken on a cached page with the lock held (or by something that
+	// already holds one), so a page that's unused now can't be picked up while it's released.
+	list<u64> unused;
+	for (const auto &entry : pages_) {
+		if (page::get_from_pfn(entry.value).refcount() == 0) {
+			unused.append(entry.key);
+		}
+	}
+
+	u64 released = 0;
+	for (u64 index : unused) {
+		u64 pfn;
+		if (pages_.try_get_value(index, pfn)) {
+			pages_.remove(index);
+
+			memory_manager::get().pgalloc().free_pages(pfn, 0);
+			released++;
+		}
+	}
+
+	return released;
+}
@@ -6,6 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/fs/page-cache.h>
 #include <stacsos/kernel/fs/vfs.h>
 
 using namespace stacsos::kernel;
@@ -27,3 +28,25 @@ fs_node *vfs::lookup(const char *path)
 
 	return rootfs_.root().lookup(&path[1]);
 }
+
+void vfs::register_cache(page_cache &cache)
+{
+	unique_irq_lock l(caches_lock_);
+	caches_.append(&cache);
+}
+
+/**
+ * Releases the pages of every file's page cache that aren't mapped anywhere, because memory is
+ * short.  Returns the number of pages released.
+ */
+u64 vfs::release_cached_pages()
+{
+	unique_irq_lock l(caches_lock_);
+
+	u64 released = 0;
+	for (auto *cache : caches_) {
+		released += cache->release_unused_pages();
+	}
+
+	return released;
+}
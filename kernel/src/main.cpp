@@ -120,6 +120,11 @@ static void continue_main()
 
 	devfs_dir->mount(*new devfs());
 
+	// This needs every core to be online, to answer TLB shootdowns.
+	if (stacsos::memops::strcmp(config::get().get_option_or_default("loa-selftest", "no"), "yes") == 0) {
+		stacsos::kernel::mem::memory_manager::get().perform_large_object_selftest();
+	}
+
 	// Launch the init process
 	auto init_proc = process_manager::get().create_process("/usr/init", "");
 	if (!init_proc) {
@@ -5,61 +5,522 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/fs/page-cache.h>
 #include <stacsos/kernel/mem/address-space-region.h>
 #include <stacsos/kernel/mem/address-space.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
 #include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
 
 using namespace stacsos::kernel::mem;
 
+// The allocation order of a 2M page.
+static const order_t large_page_order = 9;
+
+// The allocation order of the memory behind a mapping of the given size.
+static order_t mapping_order(mapping_size size)
+{
+	switch (size) {
+	case mapping_size::m1g:
+		return 18;
+	case mapping_size::m2m:
+		return large_page_order;
+	default:
+		return 0;
+	}
+}
+
 address_space *address_space::create_linked(u64 alloc_rgn_start)
 {
 	auto linked_pt = pt_->create_linked_copy(pta_);
 	return new address_space(pta_, linked_pt, alloc_rgn_start);
 }
 
-address_space_region *address_space::alloc_region(u64 size, region_flags flags, bool allocate)
+/**
+ * Picks the base address for a new region of the given size.  Must be called with the lock held.
+ */
+u64 address_space::reserve_range(u64 size)
 {
 	u64 aligned_size = PAGE_ALIGN_UP(size);
+
+	// Give big regions a 2M-aligned base, so that they can be mapped with large pages.
+	if (aligned_size >= MB(2)) {
+		next_alloc_rgn_ = (next_alloc_rgn_ + (MB(2) - 1)) & ~(MB(2) - 1);
+	}
+
 	u64 base = next_alloc_rgn_;
 	next_alloc_rgn_ += aligned_size;
 
+	return base;
+}
+
+address_space_region *address_space::alloc_region(u64 size, region_flags flags, bool allocate)
+{
+	u64 base;
+
+	{
+		unique_irq_lock l(lock_);
+		base = reserve_range(size);
+	}
+
 	return add_region(base, size, flags, allocate);
 }
 
+/**
+ * Maps part of a file into this address space.  Nothing is read up front: each page is mapped from
+ * the file's page cache the first time it is touched.  Pages are always mapped read-only, so that
+ * a write to a writable mapping gives this address space a private copy of the page, and the file's
+ * contents are left alone.
+ */
+address_space_region *address_space::map_file(fs::page_cache &cache, u64 offset, u64 size, region_flags flags)
+{
+	auto rgn = new address_space_region();
+	rgn->size = size;
+	rgn->flags = flags;
+	rgn->storage = nullptr;
+	rgn->cache = &cache;
+	rgn->cache_offset = offset;
+
+	unique_irq_lock l(lock_);
+
+	rgn->base = reserve_range(size);
+	rgn->id = next_region_id_++;
+	regions_.append(rgn);
+
+	return rgn;
+}
+
 address_space_region *address_space::add_region(u64 base, u64 size, region_flags flags, bool allocate)
 {
 	auto rgn = new address_space_region();
 	rgn->base = base;
 	rgn->size = size;
 	rgn->flags = flags;
+	rgn->cache = nullptr;
+	rgn->cache_offset = 0;
 
 	//dprintf("as: add-region base=%lx size=%lx flags=%d alloc=%d\n", base, size, flags, allocate);
 
 	if (allocate) {
 		u64 pages = (size + (PAGE_SIZE - 1)) / PAGE_SIZE;
-		rgn->storage = &memory_manager::get().pgalloc().allocate_pages(log2_ceil(pages), page_allocation_flags::zero).to_page();
-
-		u64 cur_virt = base;
-		u64 cur_phys = rgn->storage->base_address();
+		rgn->storage = &memory_manager::get().pgalloc().allocate_pages(log2_ceil(pages), page_allocation_flags::zero | page_allocation_flags::reclaim).to_page();
 
-		for (u64 i = 0; i < pages; i++) {
-			//dprintf("map virt=%p phys=%p\n", cur_virt, cur_phys);
-			pt_->map(pta_, cur_virt, cur_phys, mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable, mapping_size::m4k);
-			cur_virt += PAGE_SIZE;
-			cur_phys += PAGE_SIZE;
+		mapping_flags mflags = mapping_flags::present | mapping_flags::user_accessable;
+		if ((flags & region_flags::writable) == region_flags::writable) {
+			mflags |= mapping_flags::writable;
 		}
+
+		unique_irq_lock l(lock_);
+
+		// The storage is physically contiguous (and, from the buddy allocator, naturally aligned), so
+		// the page table can use large pages wherever the virtual address lines up too.
+		pt_->map_range(pta_, base, rgn->storage->base_address(), pages, mflags);
+
+		rgn->id = next_region_id_++;
+		regions_.append(rgn);
 	} else {
+		// Nothing is allocated up front: each page is allocated (and zeroed) by populate(), the
+		// first time it is touched.
 		rgn->storage = nullptr;
-	}
 
-	regions_.append(rgn);
+		unique_irq_lock l(lock_);
+		rgn->id = next_region_id_++;
+		regions_.append(rgn);
+	}
 
 	return rgn;
 }
 
-void address_space::remove_region(u64 base, u64 size, region_flags flags)
+/**
+ * Handles a fault on a user address, by either backing the page it lies in with a freshly zeroed
+ * page (if the address belongs to a demand-populated region), or by giving this address space its
+ * own copy of a page it is sharing copy-on-write.  Returns true if the faulting access can be
+ * retried.
+ */
+bool address_space::populate(u64 address)
+{
+	u64 page_address = PAGE_ALIGN_DOWN(address);
+	u64 large_page_address = address & ~(MB(2) - 1);
+
+	// The region may be removed (and freed) as soon as the lock is dropped, so work from a copy.
+	address_space_region rgn;
+	mapping existing;
+	bool large_page_unmapped;
+	{
+		unique_irq_lock l(lock_);
+
+		auto *found = find_region(address);
+		if (!found) {
+			return false;
+		}
+
+		rgn = *found;
+		existing = pt_->get_mapping(page_address);
+		large_page_unmapped = pt_->is_unmapped(large_page_address, mapping_size::m2m);
+	}
+
+	if (rgn.storage != nullptr || (rgn.flags & region_flags::all) == region_flags::inaccessible) {
+		return false;
+	}
+
+	bool writable = (rgn.flags & region_flags::writable) == region_flags::writable;
+
+	if (existing.result == mapping_result::ok) {
+		// A fault on a page that is already there is either a write to a shared page, or a protection
+		// violation that populating the region can't fix.
+		if (!writable) {
+			return false;
+		}
+
+		// Another thread in this address space may already have taken its own copy of the page.
+		if ((existing.flags & mapping_flags::writable) == mapping_flags::writable) {
+			return true;
+		}
+
+		return copy_on_write(page_address, existing.address);
+	}
+
+	if (rgn.cache) {
+		return populate_from_cache(rgn, page_address);
+	}
+
+	mapping_flags flags = mapping_flags::present | mapping_flags::user_accessable;
+	if (writable) {
+		flags |= mapping_flags::writable;
+	}
+
+	// If the region asked for large pages, covers the whole 2M page around the fault, and none of it
+	// has been touched yet, back it with a single large page.  Otherwise (or if there's no 2M block
+	// free, in which case populate_zeroed fails) fall back to a 4K page.
+	bool large_pages = (rgn.flags & region_flags::large_pages) == region_flags::large_pages;
+	bool large_page_fits = large_page_address >= rgn.base && large_page_address + MB(2) <= rgn.base + rgn.size;
+	if (large_pages && large_page_fits && large_page_unmapped && populate_zeroed(rgn, large_page_address, mapping_size::m2m, flags)) {
+		return true;
+	}
+
+	return populate_zeroed(rgn, page_address, mapping_size::m4k, flags);
+}
+
+/**
+ * Backs the (suitably aligned) page of the given size at the given address with freshly zeroed
+ * memory.  The region is a copy, taken with the lock held.  Returns false if the memory couldn't be
+ * allocated.
+ */
+bool address_space::populate_zeroed(const address_space_region &rgn, u64 address, mapping_size size, mapping_flags flags)
 {
-	//
+	order_t order = size == mapping_size::m2m ? large_page_order : 0;
+
+	// Don't hold the lock while allocating: the page allocator may need to reclaim memory, and
+	// zeroing the page takes a while.
+	auto result = memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::zero | page_allocation_flags::reclaim);
+	if (result.is_error()) {
+		return false;
+	}
+
+	pfn_t pfn = result.get_range_start();
+
+	{
+		unique_irq_lock l(lock_);
+
+		// Another thread in this address space may have faulted on the same page (or, for a large
+		// page, anywhere in it) in the meantime, in which case its page wins, and the access can
+		// simply be retried.
+		if (can_populate(rgn, address, size)) {
+			pt_->map(pta_, address, page::get_from_pfn(pfn).base_address(), flags, size);
+			return true;
+		}
+	}
+
+	memory_manager::get().pgalloc().free_pages(pfn, order);
+	return true;
+}
+
+/**
+ * Returns true if a fault handler, working from a copy of a region, may map a page of the given size at
+ * the given address: the region mustn't have been removed in the meantime, and nobody else may have
+ * mapped anything there.  Must be called with the lock held.
+ */
+bool address_space::can_populate(const address_space_region &rgn, u64 address, mapping_size size)
+{
+	auto *current = find_region(address);
+	return current && current->id == rgn.id && pt_->is_unmapped(address, size);
+}
+
+/**
+ * Maps the page of a file-backed region that contains the given address, from the file's page cache.
+ * The region is a copy, taken with the lock held.
+ */
+bool address_space::populate_from_cache(const address_space_region &rgn, u64 page_address)
+{
+	// This may have to read from the disk, so it mustn't be called with the lock held.
+	page *pg = rgn.cache->get_page((page_address - rgn.base + rgn.cache_offset) >> PAGE_BITS);
+	if (!pg) {
+		return false;
+	}
+
+	{
+		unique_irq_lock l(lock_);
+
+		if (can_populate(rgn, page_address, mapping_size::m4k)) {
+			pt_->map(pta_, page_address, pg->base_address(), mapping_flags::present | mapping_flags::user_accessable);
+			return true;
+		}
+	}
+
+	// Another thread got there first.
+	pg->release();
+	return true;
+}
+
+/**
+ * Breaks the sharing of a copy-on-write page, after a write to it has faulted.
+ */
+bool address_space::copy_on_write(u64 page_address, u64 shared_address)
+{
+	page &shared = page::get_from_base_address(shared_address);
+	mapping_flags flags = mapping_flags::present | mapping_flags::user_accessable | mapping_flags::writable;
+
+	// If every other owner has already taken its own copy, then this address space can just have the
+	// page back.  Going from read-only to writable doesn't need a TLB shootdown: a stale entry will just
+	// cause another (spurious) fault.
+	if (shared.refcount() == 0) {
+		unique_irq_lock l(lock_);
+
+		mapping current = pt_->get_mapping(page_address);
+		if (current.result == mapping_result::ok && current.address == shared_address) {
+			pt_->map(pta_, page_address, shared_address, flags);
+		}
+
+		return true;
+	}
+
+	auto result = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::reclaim);
+	if (result.is_error()) {
+		return false;
+	}
+
+	page &copy = page::get_from_pfn(result.get_range_start());
+	memops::memcpy(copy.base_address_ptr(), shared.base_address_ptr(), PAGE_SIZE);
+
+	{
+		unique_irq_lock l(lock_);
+
+		mapping current = pt_->get_mapping(page_address);
+		if (current.result != mapping_result::ok || current.address != shared_address) {
+			l.unlock();
+
+			memory_manager::get().pgalloc().free_pages(copy.pfn(), 0);
+			return true;
+		}
+
+		pt_->map(pta_, page_address, copy.base_address(), flags);
+	}
+
+	// Other threads of this address space may still be reading the shared page through their TLBs.
+	arch::x86::x86_core::flush_tlb(pt_->effective_cr3(), page_address, 1);
+
+	if (shared.release()) {
+		memory_manager::get().pgalloc().free_pages(shared.pfn(), 0);
+	}
+
+	return true;
+}
+
+/**
+ * Creates a copy of this address space, in which every page is shared copy-on-write with this one.
+ * The pages are made read-only in the copy only, so this address space must not be in use by any
+ * thread: it is intended for cloning a pristine process image, not for forking a running process.
+ */
+address_space *address_space::clone()
+{
+	struct shared_mapping {
+		u64 va, address;
+	};
+
+	list<address_space_region *> copy_regions;
+	list<shared_mapping> mappings;
+	u64 next_alloc_rgn;
+
+	// Only gather what needs copying with the lock held: building the copy allocates page tables,
+	// which can't be done with interrupts off.  A reference is taken on each page straight away,
+	// though, so that it can't be freed before the copy maps it.
+	{
+		unique_irq_lock l(lock_);
+
+		next_alloc_rgn = next_alloc_rgn_;
+
+		for (address_space_region *rgn : regions_) {
+			auto copy_rgn = new address_space_region();
+			copy_rgn->base = rgn->base;
+			copy_rgn->size = rgn->size;
+			copy_rgn->flags = rgn->flags;
+			copy_rgn->cache = rgn->cache;
+			copy_rgn->cache_offset = rgn->cache_offset;
+
+			// The copy doesn't own any contiguous storage: its pages are found through its page tables.
+			copy_rgn->storage = nullptr;
+			copy_regions.append(copy_rgn);
+
+			for (u64 va = rgn->base; va < rgn->base + rgn->size; va += PAGE_SIZE) {
+				mapping m = pt_->get_mapping(va);
+				if (m.result != mapping_result::ok) {
+					continue;
+				}
+
+				page::get_from_base_address(m.address).acquire();
+				mappings.append(shared_mapping { va, m.address });
+			}
+		}
+	}
+
+	auto copy = memory_manager::get().root_address_space().create_linked(next_alloc_rgn);
+
+	// Pages of writable regions are copied on the first write to them, but pages of read-only regions
+	// (e.g. program text) stay shared by every copy.
+	for (const auto &m : mappings) {
+		copy->pt_->map(pta_, m.va, m.address, mapping_flags::present | mapping_flags::user_accessable);
+	}
+
+	// Nothing else can see the copy yet, but its lock is taken anyway, as it is for every other change
+	// to a region list.
+	unique_irq_lock l(copy->lock_);
+
+	for (address_space_region *copy_rgn : copy_regions) {
+		copy_rgn->id = copy->next_region_id_++;
+		copy->regions_.append(copy_rgn);
+	}
+
+	return copy;
+}
+
+/**
+ * Removes the region starting at the given address, unmapping it and giving back the memory behind it.
+ * Returns false if no region starts there.
+ */
+bool address_space::remove_region(u64 base)
+{
+	address_space_region *rgn = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+
+		for (address_space_region *candidate : regions_) {
+			if (candidate->base == base) {
+				rgn = candidate;
+				break;
+			}
+		}
+
+		if (!rgn) {
+			return false;
+		}
+
+		// Once the region is off the list, faults can't populate it any more.
+		regions_.remove(rgn);
+	}
+
+	release_region(rgn);
+	delete rgn;
+
+	return true;
+}
+
+/**
+ * Unmaps a region that has already been taken off the region list, and frees (or drops this address
+ * space's references to) the pages behind it, along with any page tables left empty.  Pages can only
+ * be freed once no core can reach them through its TLB, and TLB shootdowns can't be done with the lock
+ * held, so this works through the region a batch at a time.
+ */
+void address_space::release_region(address_space_region *rgn)
+{
+	static const u64 max_batch_pages = 64;
+	static const u64 max_batch_scan = 512;
+
+	u64 nr_pages = PAGE_ALIGN_UP(rgn->size) >> PAGE_BITS;
+	u64 done = 0;
+
+	list<page *> tables;
+
+	while (done < nr_pages) {
+		struct {
+			pfn_t pfn;
+			order_t order;
+		} batch[max_batch_pages];
+		u64 nr_batch = 0;
+		u64 nr_unmapped = 0;
+		u64 batch_start = done;
+
+		{
+			unique_irq_lock l(lock_);
+
+			while (done < nr_pages && nr_batch < max_batch_pages && (done - batch_start) < max_batch_scan) {
+				u64 va = rgn->base + (done << PAGE_BITS);
+
+				mapping m = pt_->get_mapping(va);
+				if (m.result != mapping_result::ok) {
+					done++;
+					continue;
+				}
+
+				// A large page goes in one go, so skip to the end of it.
+				order_t order = mapping_order(m.size);
+				u64 leaf_size = PAGE_SIZE << order;
+				u64 leaf_base = va & ~(leaf_size - 1);
+				done = min<u64>(nr_pages, (leaf_base + leaf_size - rgn->base) >> PAGE_BITS);
+
+				// Contiguous storage is freed as a whole at the end, rather than a page at a time.
+				if (!rgn->storage) {
+					batch[nr_batch++] = { (m.address - (va - leaf_base)) >> PAGE_BITS, order };
+				}
+
+				pt_->unmap(pta_, va);
+				nr_unmapped++;
+			}
+
+			if (done == nr_pages) {
+				pt_->prune(rgn->base, nr_pages, tables);
+			}
+		}
+
+		if (nr_unmapped > 0 || (done == nr_pages && !tables.empty())) {
+			arch::x86::x86_core::flush_tlb(pt_->effective_cr3(), rgn->base + (batch_start << PAGE_BITS), done - batch_start);
+		}
+
+		for (u64 i = 0; i < nr_batch; i++) {
+			// Pages shared with other address spaces (or owned by a page cache) are only freed by
+			// their last owner.
+			if (page::get_from_pfn(batch[i].pfn).release()) {
+				memory_manager::get().pgalloc().free_pages(batch[i].pfn, batch[i].order);
+			}
+		}
+	}
+
+	if (rgn->storage) {
+		memory_manager::get().pgalloc().free_pages(rgn->storage->pfn(), log2_ceil(nr_pages));
+	}
+
+	while (!tables.empty()) {
+		pta_.free(*tables.dequeue());
+	}
+}
+
+/**
+ * Frees everything in the address space, including its page tables.  Nothing may be running in it.
+ */
+address_space::~address_space()
+{
+	while (!regions_.empty()) {
+		auto rgn = regions_.dequeue();
+
+		release_region(rgn);
+		delete rgn;
+	}
+
+	// Make every core forget the page tables (and any PCID they're cached under), before they go.
+	arch::x86::x86_core::flush_tlb(pt_->effective_cr3(), 0, ~0ull);
+
+	pt_->destroy(pta_);
 }
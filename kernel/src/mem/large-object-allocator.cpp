@@ -5,6 +5,7 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/mem/large-object-allocator.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
@@ -15,6 +16,75 @@
 
 using namespace stacsos::kernel::mem;
 
+/**
+ * @brief Finds room for an extent of the given number of pages in the region, reusing a free range
+ * if there's one big enough, and otherwise taking it from the end.  The lock must be held.
+ *
+ * @return u64 The starting address of the extent, or zero if the region is full.
+ */
+u64 large_object_allocator::reserve_range(u64 nr_pages)
+{
+	auto *range = free_.find_first([nr_pages](const avl_tree<u64, u64>::node &n) { return n.data() >= nr_pages; });
+	if (range) {
+		u64 start = range->key();
+		u64 range_pages = range->data();
+
+		free_.remove(start);
+		if (range_pages > nr_pages) {
+			free_.add(start + (nr_pages << PAGE_BITS), range_pages - nr_pages);
+		}
+
+		return start;
+	}
+
+	// Extents of 2M or more start on a 2M boundary, so that they can be mapped with large pages.
+	// The gap this leaves is put back as a free range.
+	u64 start = (u64)base_;
+	if (nr_pages >= (MB(2) >> PAGE_BITS)) {
+		start = (start + (MB(2) - 1)) & ~(MB(2) - 1);
+	}
+
+	if (start + (nr_pages << PAGE_BITS) > (u64)region_base_ + size_) {
+		return 0;
+	}
+
+	u64 gap = start - (u64)base_;
+	base_ = (void *)(start + (nr_pages << PAGE_BITS));
+
+	if (gap) {
+		free_.add(start - gap, gap >> PAGE_BITS);
+	}
+
+	return start;
+}
+
+/**
+ * @brief Makes an (unmapped) extent available for reuse, merging it with the free ranges either
+ * side of it.  The lock must be held.
+ */
+void large_object_allocator::release_range(u64 start, u64 nr_pages)
+{
+	auto *prev = free_.floor(start);
+	if (prev && prev->key() + (prev->data() << PAGE_BITS) == start) {
+		start = prev->key();
+		nr_pages += prev->data();
+		free_.remove(start);
+	}
+
+	u64 next_pages;
+	if (free_.try_get_value(start + (nr_pages << PAGE_BITS), next_pages)) {
+		free_.remove(start + (nr_pages << PAGE_BITS));
+		nr_pages += next_pages;
+	}
+
+	// If this range runs up to the end of the used part of the region, just pull the end back.
+	if (start + (nr_pages << PAGE_BITS) == (u64)base_) {
+		base_ = (void *)start;
+	} else {
+		free_.add(start, nr_pages);
+	}
+}
+
 /**
  * @brief Allocates a block of memory of the given size.
  *
@@ -26,12 +96,17 @@ void *large_object_allocator::allocate(size_t size)
 	auto &pga = memory_manager::get().pgalloc();
 	auto &pta = memory_manager::get().ptalloc();
 
-	// This is technically locked by the "object allocator" spin lock.
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	u64 nr_pages = PAGE_ALIGN_UP(size) >> PAGE_BITS;
 
-	u64 nr_pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
-	u64 target = (u64)base_;
+	// The lock also serialises our changes to the kernel's page tables.
+	unique_irq_lock l(lock_);
 
-	page_table &v = memory_manager::get().root_address_space().pgtable();
+	u64 target = reserve_range(nr_pages);
+	if (!target) {
+		return nullptr;
+	}
 
 	// We've computed the maximum number of pages needed to hold the allocation,
 	// so for each bit in the number of pages required, allocate that order.
@@ -40,38 +115,45 @@ void *large_object_allocator::allocate(size_t size)
 
 	// What we're doing is allocating physical pages for each order, then
 	// "glueing" them together in the large object address space by inserting
-	// appropriate mappings into the page table.
+	// appropriate mappings into the page table.  The biggest blocks go first,
+	// so that they stay aligned (given an aligned target), and can be mapped
+	// with large pages.
 
-	// TODO: not sure how "free" is going to work... maybe some kind of
-	// balanced tree holding the allocations?  Also, what if a page
-	// allocation fails halfway through!?
-
-	int pgi = 0; // The current monotonic page counter
-	for (int i = 0; i < 32; i++) {
+	u64 pgi = 0; // The current monotonic page counter
+	for (int i = 31; i >= 0; i--) {
 		// Only allocate when the bit is set
-		if (nr_pages & (1 << i)) {
-			page &pg = pga.allocate_pages(i).to_page(); // Allocate a block of pages
-
-			// For each page in the block...
-			for (int j = 0; j < (1 << i); j++) {
-				// Map the pages in this block into the virtual address space.
-				v.map(pta, target + (PAGE_SIZE * pgi), pg.base_address() + (PAGE_SIZE * j), mapping_flags::writable);
+		if (!(nr_pages & (1ull << i))) {
+			continue;
+		}
 
-				// Increase the current page counter.
-				pgi++;
+		auto block = pga.allocate_pages(i); // Allocate a block of pages
+		if (block.is_error()) {
+			// Back out.  The blocks we've already mapped are retired, so that reclaim() unmaps
+			// and frees them in the usual way, and the rest of the range was never mapped at all.
+			u64 offset = 0;
+			for (int j = 31; j > i; j--) {
+				if (nr_pages & (1ull << j)) {
+					retired_.add(target + (offset << PAGE_BITS), 1ull << j);
+					offset += 1ull << j;
+				}
 			}
+
+			release_range(target + (pgi << PAGE_BITS), nr_pages - pgi);
+			return nullptr;
 		}
-	}
 
-	// HMM: vma_.activate();
+		// Map the pages in this block into the virtual address space.
+		v.map_range(pta, target + (PAGE_SIZE * pgi), block.to_page().base_address(), 1ull << i, mapping_flags::writable);
+		pgi += 1ull << i;
+	}
 
-	// Advance the base pointer by the number of pages we've just allocated (and mapped)
-	base_ = (void *)((uintptr_t)base_ + (nr_pages * PAGE_SIZE));
+	allocated_.add(target, nr_pages);
 	return (void *)target;
 }
 
 /**
- * @brief Frees a block of memory allocated with the corresponding allocate function.
+ * @brief Frees a block of memory allocated with the corresponding allocate function.  The memory
+ * isn't actually given back until the next call to reclaim().
  *
  * @param p A pointer to the block of memory (allocated by allocated), which is to be freed.
  */
@@ -81,7 +163,86 @@ bool large_object_allocator::free(void *p)
 		return false;
 	}
 
-	// TODO
+	unique_irq_lock l(lock_);
+
+	u64 nr_pages;
+	if (!allocated_.try_get_value((u64)p, nr_pages)) {
+		return false;
+	}
+
+	allocated_.remove((u64)p);
+	retired_.add((u64)p, nr_pages);
 
 	return true;
 }
+
+/**
+ * @brief Unmaps one retired extent, makes sure no core can still be using the old mappings, and
+ * gives its pages and virtual range back.  This waits for every other core to respond, so it
+ * mustn't be called with any locks held.
+ *
+ * @return u64 The number of pages reclaimed, or zero if there was nothing to do.
+ */
+u64 large_object_allocator::reclaim()
+{
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	// The physical blocks backing the extent, indexed by order.
+	pfn_t blocks[32];
+
+	// Page tables left empty by unmapping the extent.
+	list<page *> tables;
+
+	u64 start, nr_pages;
+	{
+		unique_irq_lock l(lock_);
+
+		auto *extent = retired_.first();
+		if (!extent) {
+			return 0;
+		}
+
+		start = extent->key();
+		nr_pages = extent->data();
+		retired_.remove(start);
+
+		// Walk the blocks in the same order that allocate() laid them out.
+		u64 va = start;
+		for (int i = 31; i >= 0; i--) {
+			if (!(nr_pages & (1ull << i))) {
+				continue;
+			}
+
+			blocks[i] = v.get_mapping(va).address >> PAGE_BITS;
+
+			for (u64 j = 0; j < (1ull << i); j++) {
+				v.unmap(pta, va);
+				va += PAGE_SIZE;
+			}
+		}
+
+		// The range may later be reused for an extent that is mapped with large pages, which can't
+		// go where a (now empty) page table is.
+		v.prune(start, nr_pages, tables);
+	}
+
+	// The region is shared by every address space.
+	arch::x86::x86_core::flush_tlb(arch::x86::x86_core::all_address_spaces, start, nr_pages);
+
+	auto &pga = memory_manager::get().pgalloc();
+	for (int i = 0; i < 32; i++) {
+		if (nr_pages & (1ull << i)) {
+			pga.free_pages(blocks[i], i);
+		}
+	}
+
+	while (!tables.empty()) {
+		pta.free(*tables.dequeue());
+	}
+
+	unique_irq_lock l(lock_);
+	release_range(start, nr_pages);
+
+	return nr_pages;
+}
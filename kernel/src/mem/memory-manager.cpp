@@ -5,12 +5,18 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/fs/vfs.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-allocator-buddy.h>
 #include <stacsos/kernel/mem/page-allocator-linear.h>
+#include <stacsos/kernel/mem/page-frame-cache.h>
 #include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
 
 extern "C" const char *_IMAGE_START;
 extern "C" const char *_IMAGE_END;
@@ -27,12 +33,13 @@ static memory_block memory_blocks[16];
 static int nr_memory_blocks;
 
 static char page_allocator_structure[0x1000];
+static char page_frame_cache_structure[sizeof(page_frame_cache)] __aligned(8);
 
 void memory_manager::init()
 {
 	dprintf("mem: init\n");
 
-	const char *pgalloc_algorithm_name = config::get().get_option_or_default("pgalloc", "linear");
+	const char *pgalloc_algorithm_name = config::get().get_option_or_default("pgalloc", "buddy");
 	dprintf("\e\x04mem: *** using the '%s' page allocator\e\x07\n", pgalloc_algorithm_name);
 
 	void *page_allocator_object = (void *)page_allocator_structure;
@@ -60,6 +67,13 @@ void memory_manager::init()
 	u64 nr_page_descriptors = (last_addr + 1) >> PAGE_BITS;
 	initialise_page_descriptors(nr_page_descriptors);
 	initialise_page_allocator(nr_page_descriptors);
+
+	// Put the per-core page frame caches in front of the page allocator, unless we've been asked not to.
+	if (memops::strcmp(config::get().get_option_or_default("pgcache", "yes"), "no") != 0) {
+		pgcache_ = new ((void *)page_frame_cache_structure) page_frame_cache(*this, *pgalloc_);
+		pgalloc_ = pgcache_;
+	}
+
 	initialise_object_allocator();
 
 	dprintf("switching to primary page table mapping...\n");
@@ -108,7 +122,7 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 		{ 0, MB(1) }, // Early BIOS data, and the ZERO page.
 		{ 0x100000, KB(24) }, // 24 kB (6 pages) of early page tables -- we should probably put these back later.
 		{ (u64)&_IMAGE_START, PAGE_ALIGN_UP((u64)&_IMAGE_END) - ((u64)&_IMAGE_START) }, // The loaded kernel image,
-		{ (u64)&_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000,
+		{ (u64)_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000,
 			PAGE_ALIGN_UP(sizeof(page) * nr_page_descriptors) } // Dynamic data, containing the page descriptors.
 	};
 
@@ -209,4 +223,96 @@ void memory_manager::activate_primary_mapping()
 	root_address_space_->pgtable().activate();
 }
 
-bool memory_manager::try_handle_page_fault(u64 faulting_address) { return false; }
+/**
+ * Called when a page fault occurs.  User regions are populated lazily, so a fault in the lower half
+ * may simply be the first touch of a page in the current thread's address space.
+ */
+bool memory_manager::try_handle_page_fault(u64 faulting_address)
+{
+	if (faulting_address >= 0x8000'0000'0000'0000) {
+		return false;
+	}
+
+	// The idle task, and the temporary one a core runs on while it boots, don't belong to a thread
+	// (and so have no address space to populate).
+	auto *current_tcb = arch::core::this_core().get_current_tcb();
+	if (current_tcb == nullptr || current_tcb->entity == nullptr) {
+		return false;
+	}
+
+	return sched::thread::current().owner().addrspace().populate(faulting_address);
+}
+
+/**
+ * Performs one small piece of background housekeeping, on behalf of an idle core.  Returns true if
+ * there was something to do, so the caller can keep going until it runs out (or has better things
+ * to do).
+ */
+bool memory_manager::do_idle_work() { return objalloc_.reclaim_large_objects() > 0 || (pgcache_ && pgcache_->zero_idle_pages()); }
+
+/**
+ * Asks everything that caches memory (including the file page caches) to give back what it isn't
+ * using, because a page allocation has failed.  Large objects that have been freed, and processes
+ * that have terminated, but which the idle loop hasn't got round to yet, are finished off too.  Both
+ * of those wait for other cores, so this is only called for allocations that are made with no locks
+ * held (i.e. that pass page_allocation_flags::reclaim).  Returns the number of pages released by the
+ * allocators and caches, plus one for each process freed -- i.e. zero if nothing was.
+ */
+u64 memory_manager::reclaim_memory()
+{
+	u64 released = 0;
+
+	u64 nr_pages;
+	while ((nr_pages = objalloc_.reclaim_large_objects()) > 0) {
+		released += nr_pages;
+	}
+
+	while (sched::process_manager::get().reap_terminated_process()) {
+		released++;
+	}
+
+	return released + fs::vfs::get().release_cached_pages() + objalloc_.shrink();
+}
+
+/**
+ * Checks that a range given back by the large object allocator can be reused for an extent that is
+ * mapped with large pages.  This frees memory and waits for TLB shootdowns, so it must run in a thread,
+ * with every core online.
+ */
+void memory_manager::perform_large_object_selftest()
+{
+	dprintf("*** LARGE OBJECT ALLOCATOR SELF TEST ***\n");
+
+	// An extent of 2M plus one page is mapped with a 2M page followed by a 4K page, so it leaves a page
+	// table in the 2M slot after its first one.
+	dprintf("(1) Allocate, free and reclaim 2M+4K\n");
+	void *first = objalloc_.alloc(MB(2) + PAGE_SIZE);
+	if (!first) {
+		panic("large object allocation failed during self-test");
+	}
+
+	dprintf("  allocated %p\n", first);
+	objalloc_.free(first);
+	while (objalloc_.reclaim_large_objects() > 0) { }
+
+	// This lands at the same base (the end of the used part of the region), and needs a 2M page over
+	// where that page table was.
+	dprintf("(2) Allocate 4M over the same range\n");
+	void *second = objalloc_.alloc(MB(4));
+	if (!second) {
+		panic("large object allocation failed during self-test");
+	}
+
+	dprintf("  allocated %p\n", second);
+	if (second != first) {
+		dprintf("  WARNING: not at the same base, so the reuse wasn't exercised\n");
+	}
+
+	memops::memset(second, 0xa5, MB(4));
+
+	dprintf("(3) Free and reclaim 4M\n");
+	objalloc_.free(second);
+	while (objalloc_.reclaim_large_objects() > 0) { }
+
+	dprintf("*** LARGE OBJECT ALLOCATOR SELF TEST PASSED ***\n");
+}
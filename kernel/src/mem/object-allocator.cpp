@@ -5,68 +5,252 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/irq-flags.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page.h>
 
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::mem;
 
 #define VMALLOC_AREA 0xfffff00000000000
 
+// The magazines are strictly per-core, so rather than a lock, we just need to stop ourselves being
+// interrupted (and so possibly rescheduled onto another core) while we're using one, with
+// local_irq_save/local_irq_restore.
+
+object_allocator::owned_lock::owned_lock(object_allocator &oa)
+	: oa_(oa)
+{
+	oa_.object_allocator_lock_.lock(&flags_);
+	oa_.lock_owner_ = core::this_core_id();
+}
+
+object_allocator::owned_lock::~owned_lock()
+{
+	oa_.lock_owner_ = -1;
+	oa_.object_allocator_lock_.unlock(flags_);
+}
+
+// The object sizes of each slab size class, smallest first.  These must match the caches in
+// object_allocator.
+static const size_t class_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048, 4096 };
+
+/**
+ * Maps an allocation size, rounded up to a 16-byte granule, to the smallest size class that
+ * holds it -- so that picking a class is a single lookup.
+ */
+static constexpr size_t size_class_granule_bits = 4;
+
+struct size_class_table {
+	u8 classes[(4096 >> size_class_granule_bits) + 1];
+
+	constexpr size_class_table()
+		: classes {}
+	{
+		u8 cls = 0;
+		for (size_t granule = 0; granule < ARRAY_SIZE(classes); granule++) {
+			while (class_sizes[cls] < (granule << size_class_granule_bits)) {
+				cls++;
+			}
+
+			classes[granule] = cls;
+		}
+	}
+};
+
+static constexpr size_class_table size_class_lookup;
+
 object_allocator::object_allocator()
-	: loa_((void *)VMALLOC_AREA, GB(1))
+	: lock_owner_(-1)
+	, loa_((void *)VMALLOC_AREA, GB(1))
+{
+	caches_[0] = &cache16_;
+	caches_[1] = &cache32_;
+	caches_[2] = &cache48_;
+	caches_[3] = &cache64_;
+	caches_[4] = &cache96_;
+	caches_[5] = &cache128_;
+	caches_[6] = &cache192_;
+	caches_[7] = &cache256_;
+	caches_[8] = &cache384_;
+	caches_[9] = &cache512_;
+	caches_[10] = &cache768_;
+	caches_[11] = &cache1024_;
+	caches_[12] = &cache2048_;
+	caches_[13] = &cache4096_;
+
+	for (int cls = 0; cls < nr_size_classes; cls++) {
+		assert(caches_[cls]->slab_object_size() == class_sizes[cls]);
+	}
+
+	for (int core = 0; core < core_manager::max_cores; core++) {
+		for (int cls = 0; cls < nr_size_classes; cls++) {
+			magazines_[core].mags[cls][0].count = 0;
+			magazines_[core].mags[cls][1].count = 0;
+			magazines_[core].loaded[cls] = 0;
+		}
+	}
+}
+
+/**
+ * Returns the slab size class for an allocation of the given size, or -1 if it's too big for the
+ * slabs.
+ */
+int object_allocator::size_class(size_t size)
 {
+	if (size > max_slab_object_size) {
+		return -1;
+	}
+
+	return size_class_lookup.classes[(size + ((1 << size_class_granule_bits) - 1)) >> size_class_granule_bits];
+}
+
+/**
+ * The most objects a magazine of the given class holds.  Magazines of the biggest objects are kept
+ * short, so that they don't pin too much memory on each core.
+ */
+u32 object_allocator::magazine_rounds(int cls) { return class_sizes[cls] >= 2048 ? magazine_size / 4 : magazine_size; }
+
+/**
+ * Fills an empty magazine halfway from the slabs, so that there's room for frees as well as
+ * allocations before we need to come back.
+ */
+void object_allocator::refill(int cls, magazine &m)
+{
+	owned_lock l(*this);
+
+	while (m.count < magazine_rounds(cls) / 2) {
+		m.rounds[m.count++] = caches_[cls]->allocate();
+	}
+}
+
+/**
+ * Returns every object in a magazine to its slab.
+ */
+void object_allocator::flush(magazine &m)
+{
+	owned_lock l(*this);
+
+	while (m.count > 0) {
+		slab_cache_base::free_object(m.rounds[--m.count]);
+	}
 }
 
 void *object_allocator::alloc(size_t size)
 {
-	unique_irq_lock l(object_allocator_lock_);
-
-	if (size <= 16) {
-		return cache16_.allocate();
-	} else if (size <= 32) {
-		return cache32_.allocate();
-	} else if (size <= 64) {
-		return cache64_.allocate();
-	} else if (size <= 128) {
-		return cache128_.allocate();
-	} else if (size <= 256) {
-		return cache256_.allocate();
-	} else if (size <= 512) {
-		return cache512_.allocate();
-	} else if (size <= 1024) {
-		return cache1024_.allocate();
+	int cls = size_class(size);
+	if (cls < 0) {
+		return loa_.allocate(size);
+	}
+
+	u64 flags = local_irq_save();
+
+	core_magazines &cm = magazines_[core::this_core_id()];
+	magazine *m = &cm.mags[cls][cm.loaded[cls]];
+
+	if (m->count == 0) {
+		magazine *other = &cm.mags[cls][cm.loaded[cls] ^ 1];
+		if (other->count > 0) {
+			cm.loaded[cls] ^= 1;
+			m = other;
+		} else {
+			refill(cls, *m);
+		}
 	}
 
-	return loa_.allocate(size);
+	void *ptr = m->rounds[--m->count];
+	local_irq_restore(flags);
+
+	return ptr;
 }
 
 void object_allocator::free(void *ptr)
 {
-	unique_irq_lock l(object_allocator_lock_);
+	if (!ptr) {
+		return;
+	}
 
 	if (loa_.ptr_in_region(ptr)) {
 		if (!loa_.free(ptr)) {
 			panic("unable to free large object");
 		}
-	} else {
-		if (cache16_.try_free(ptr))
-			return;
-		if (cache32_.try_free(ptr))
-			return;
-		if (cache64_.try_free(ptr))
-			return;
-		if (cache128_.try_free(ptr))
-			return;
-		if (cache256_.try_free(ptr))
-			return;
-		if (cache512_.try_free(ptr))
-			return;
-		if (cache1024_.try_free(ptr))
-			return;
-
-		panic("unable to free object");
+
+		return;
+	}
+
+	slab_cache_base *cache = page::get_from_base_address(virt_to_phys(ptr)).slab_cache();
+	if (!cache) {
+		panic("unable to free object %p", ptr);
+	}
+
+	int cls = size_class(cache->slab_object_size());
+
+	u64 flags = local_irq_save();
+
+	core_magazines &cm = magazines_[core::this_core_id()];
+	magazine *m = &cm.mags[cls][cm.loaded[cls]];
+
+	if (m->count == magazine_rounds(cls)) {
+		magazine *other = &cm.mags[cls][cm.loaded[cls] ^ 1];
+		if (other->count < magazine_rounds(cls)) {
+			cm.loaded[cls] ^= 1;
+			m = other;
+		} else {
+			flush(*m);
+		}
 	}
+
+	m->rounds[m->count++] = ptr;
+	local_irq_restore(flags);
+}
+
+/**
+ * Gives memory that the object allocator is holding on to, but not using, back to the page
+ * allocator.  This core's magazines are emptied into the slabs first, so that as many slabs as
+ * possible end up empty.  (Other cores' magazines are left alone; they're small, and belong to
+ * them.)
+ *
+ * @return u64 The number of pages released.
+ */
+u64 object_allocator::shrink()
+{
+	u64 flags = local_irq_save();
+
+	// If we're being asked to shrink because of a page allocation we made ourselves, while
+	// holding the lock, then there's nothing we can safely do.
+	if (lock_owner_ == core::this_core_id()) {
+		local_irq_restore(flags);
+		return 0;
+	}
+
+	core_magazines &cm = magazines_[core::this_core_id()];
+	for (int cls = 0; cls < nr_size_classes; cls++) {
+		flush(cm.mags[cls][0]);
+		flush(cm.mags[cls][1]);
+	}
+
+	u64 released = 0;
+	{
+		owned_lock l(*this);
+
+		for (int cls = 0; cls < nr_size_classes; cls++) {
+			released += caches_[cls]->shrink();
+		}
+	}
+
+	local_irq_restore(flags);
+	return released;
 }
+
+/**
+ * Finishes freeing one large object.  This must be called without any locks held; see
+ * large_object_allocator::reclaim().
+ *
+ * @return u64 The number of pages released.
+ */
+u64 object_allocator::reclaim_large_objects() { return loa_.reclaim(); }
@@ -14,30 +14,10 @@ using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
-// Represents the contents of a free page, that can hold useful metadata.
-struct page_metadata {
-	pfn_t next_free;
-
-	/**
-	 * @brief Checks to see if the next_free pointer is valid or not.  Note, this actually
-	 * only checks to see if the next_free pointer is /invalid/ -- it doesn't necessarily
-	 * guarantee that a pointer that looks valid *is* valid.
-	 *
-	 * @return false Returns false if the next_free point is invalid.
-	 * @return true Returns true otherwise.
-	 */
-	bool has_next_free() const { return next_free != INVALID_PFN; }
-};
-
-/**
- * @brief Returns a pointer to the metadata structure that is held within a free page.  This CANNOT be used on
- * pages that have been allocated, as they are owned by the requesting code.  Once pages have been freed, or
- * are being returned to the allocator, this metadata can be used.
- *
- * @param pfn The PFN of the page on which to retrieve the metadata struct.
- * @return page_metadata* The metadata structure.
- */
-static inline page_metadata *metadata(pfn_t pfn) { return (page_metadata *)page::get_from_pfn(pfn).base_address_ptr(); }
+// The free lists are threaded through the page descriptors (rather than through the free pages
+// themselves), which means a block can be unlinked in constant time without touching its memory,
+// and checking whether a buddy is free is just a look at its descriptor.
+static inline page &descriptor(pfn_t pfn) { return page::get_from_pfn(pfn); }
 
 /**
  * @brief Dumps out (via the debugging routines) the current state of the buddy allocator's free lists.
@@ -59,11 +39,8 @@ void page_allocator_buddy::dump() const
 			continue;
 		}
 
-		// Get the pointer to the first free page in the free list.
-		pfn_t current_free_page = free_list_[order];
-
-		// While there /is/ currently a free page in the list...
-		do {
+		// Walk the free list, until we fall off the end.
+		for (pfn_t current_free_page = free_list_[order]; current_free_page != INVALID_PFN; current_free_page = descriptor(current_free_page).next_free_) {
 			if (order == 0) {
 				// If this is order-0, then there's only one page in the free block, so no need
 				// to print out a range.
@@ -71,18 +48,9 @@ void page_allocator_buddy::dump() const
 			} else {
 				// Otherwise, print out the extents of this free block, using the PFN of the
 				// starting page, up to and INCLUDING the PFN of the last page in the block.
-				dprintf("%lu--%lu ", current_free_page, current_free_page + ((1 << order) - 1));
-			}
-
-			// Break out of the loop if there isn't a next page in the list.
-			if (!metadata(current_free_page)->has_next_free()) {
-				break;
+				dprintf("%lu--%lu ", current_free_page, current_free_page + (pages_per_block(order) - 1));
 			}
-
-			// Advance to the next page, by interpreting the free page as holding metadata,
-			// and reading the appropriate field.
-			current_free_page = metadata(current_free_page)->next_free;
-		} while (true);
+		}
 
 		// New line for the next order.
 		dprintf("\n");
@@ -91,10 +59,22 @@ void page_allocator_buddy::dump() const
 	dprintf("stats: free=%lu, used=%lu\n", get_stats().free_pages, get_stats().used_pages);
 }
 
-/**************************************************************************************/
-/* The following functions are part of the private API, and have been implemented for */
-/* you.  You are not required to use them, but you may find them very useful.         */
-/**************************************************************************************/
+/**
+ * @brief Determines whether the given block is currently sitting, whole, in the free list of the given order.
+ *
+ * @param order The order of the block.
+ * @param block_start The PFN of the first page of the block.
+ * @return true if the block is free at exactly that order.
+ */
+bool page_allocator_buddy::is_free_block(order_t order, pfn_t block_start) const
+{
+	if (block_start >= pfn_limit_) {
+		return false;
+	}
+
+	const page &pg = descriptor(block_start);
+	return pg.state_ == page_state::free && pg.free_order_ == order;
+}
 
 /**
  * @brief Inserts a block of pages into the free list for the given order.
@@ -105,42 +85,26 @@ void page_allocator_buddy::dump() const
 void page_allocator_buddy::insert_free_block(order_t order, pfn_t block_start)
 {
 	// Assert that the given order is in the range of orders we support.
-	assert(order >= 0 && order <= LAST_ORDER);
+	assert(order <= LAST_ORDER);
 
 	// Assert that the starting page in the block is aligned to the requested order.
 	assert(block_aligned(order, block_start));
 
-	// Iterate through the free list, until we get to the position where the
-	// block should be inserted, i.e. ordered by page frame number.
-	pfn_t target = block_start;
+	page &pg = descriptor(block_start);
+	pg.state_ = page_state::free;
+	pg.free_order_ = order;
 
-	if (free_list_[order] == INVALID_PFN) {
-		// If the free list is empty, update the list head.
-		free_list_[order] = block_start;
+	// Push the block onto the front of the list.
+	pg.prev_free_ = INVALID_PFN;
+	pg.next_free_ = free_list_[order];
 
-		// And, make sure the page metadata holds an invalid PFN.
-		metadata(block_start)->next_free = INVALID_PFN;
-	} else {
-		// Otherwise, iterate until we find the right position.
-		pfn_t current = free_list_[order];
-		pfn_t prev = INVALID_PFN;
-		do {
-			if (current != INVALID_PFN && block_start > current) {
-				prev = current;
-				current = metadata(current)->next_free;
-			} else {
-				// And, once we're in the right place, insert the block.
-				if (prev == INVALID_PFN) {
-					free_list_[order] = block_start;
-				} else {
-					metadata(prev)->next_free = block_start;
-				}
-
-				metadata(block_start)->next_free = current;
-				break;
-			}
-		} while (1);
+	if (free_list_[order] != INVALID_PFN) {
+		descriptor(free_list_[order]).prev_free_ = block_start;
 	}
+
+	free_list_[order] = block_start;
+	nr_free_blocks_[order]++;
+	nonempty_orders_ |= 1u << order;
 }
 
 /**
@@ -152,95 +116,243 @@ void page_allocator_buddy::insert_free_block(order_t order, pfn_t block_start)
 void page_allocator_buddy::remove_free_block(order_t order, pfn_t block_start)
 {
 	// Assert that the given order is in the range of orders we support.
-	assert(order >= 0 && order <= LAST_ORDER);
+	assert(order <= LAST_ORDER);
 
 	// Assert that the starting page in the block is aligned to the requested order.
 	assert(block_aligned(order, block_start));
 
-	pfn_t current = free_list_[order];
-	pfn_t prev = INVALID_PFN;
-
-	// Loop through blocks in the free list, until we find the one we want.
-	while (current != block_start) {
-		prev = current;
-		current = metadata(current)->next_free;
-	}
-
-	// Check that we /actually/ found the one we want.
-	if (current != block_start) {
+	// Check that the block really is in this free list.
+	if (!is_free_block(order, block_start)) {
 		panic("block not in free list");
 	}
 
-	// Remove from the list (taking care to modify the correct slot).
-	if (prev == INVALID_PFN) {
-		free_list_[order] = metadata(current)->next_free;
+	page &pg = descriptor(block_start);
+
+	// Unlink from the list (taking care to modify the list head, if we're at the front).
+	if (pg.prev_free_ == INVALID_PFN) {
+		free_list_[order] = pg.next_free_;
 	} else {
-		metadata(prev)->next_free = metadata(current)->next_free;
+		descriptor(pg.prev_free_).next_free_ = pg.next_free_;
 	}
 
-	metadata(current)->next_free = INVALID_PFN;
-}
+	if (pg.next_free_ != INVALID_PFN) {
+		descriptor(pg.next_free_).prev_free_ = pg.prev_free_;
+	}
+
+	pg.state_ = page_state::allocated;
+	pg.next_free_ = INVALID_PFN;
+	pg.prev_free_ = INVALID_PFN;
 
-/*************************************************************************************/
-/* The following functions are part of the private API, and so only need to be       */
-/* implemented if you plan on using them.  If you do not use them, then remove them. */
-/*************************************************************************************/
+	if (--nr_free_blocks_[order] == 0) {
+		nonempty_orders_ &= ~(1u << order);
+	}
+}
 
 /**
  * @brief Splits a free block of pages from a given order, into two halves into a lower order.
  *
- * ** You are required to implement this function **
  * @param order The order in which the free block current exists.
  * @param block_start The starting page of the block to be split.
  */
-void page_allocator_buddy::split_block(order_t order, pfn_t block_start) { panic("TODO"); }
+void page_allocator_buddy::split_block(order_t order, pfn_t block_start)
+{
+	assert(order > 0);
+
+	remove_free_block(order, block_start);
+
+	// Insert the upper half first, so that the lower half ends up at the front of the list, and
+	// is the one that gets picked next.
+	insert_free_block(order - 1, block_start + pages_per_block(order - 1));
+	insert_free_block(order - 1, block_start);
+}
 
 /**
  * @brief Merges two buddy-adjacent free blocks in one order, into a block in the next higher order.
  *
- * ** You are required to implement this function **
  * @param order The order in which to merge buddies.
  * @param either_buddy Either buddy page in the free block.
+ * @return pfn_t The starting page of the merged block.
  */
-void page_allocator_buddy::merge_buddies(order_t order, pfn_t either_buddy) { panic("TODO"); }
+pfn_t page_allocator_buddy::merge_buddies(order_t order, pfn_t either_buddy)
+{
+	assert(order < LAST_ORDER);
 
-/************************************************************************************/
-/* The following functions are part of the public API, and so /must/ be implemented */
-/************************************************************************************/
+	pfn_t other_buddy = buddy_of(order, either_buddy);
+
+	remove_free_block(order, either_buddy);
+	remove_free_block(order, other_buddy);
+
+	pfn_t merged = either_buddy < other_buddy ? either_buddy : other_buddy;
+	insert_free_block(order + 1, merged);
+
+	return merged;
+}
 
 /**
- * @brief Inserts pages that are known to be free into the buddy allocator.
+ * @brief Takes a block of the given order off the free lists, splitting a larger block if
+ * necessary.  The lock must be held.
  *
- * ** You are required to implement this function **
+ * @return pfn_t The starting page of the block, or INVALID_PFN if there's nothing big enough.
+ */
+pfn_t page_allocator_buddy::allocate_block(order_t order)
+{
+	// Find the lowest non-empty order that can satisfy the request.
+	u32 candidates = nonempty_orders_ & ~((1u << order) - 1);
+	if (!candidates) {
+		return INVALID_PFN;
+	}
+
+	order_t current_order = __builtin_ctz(candidates);
+	pfn_t block = free_list_[current_order];
+
+	// Break the block down until we get to the order we want.
+	while (current_order > order) {
+		split_block(current_order, block);
+		current_order--;
+	}
+
+	remove_free_block(order, block);
+	free_pages_ -= pages_per_block(order);
+
+	return block;
+}
+
+/**
+ * @brief Puts a block back on the free lists, merging it with its buddy for as long as
+ * possible.  The lock must be held.
+ */
+page_allocator_error page_allocator_buddy::free_block(pfn_t block_start, order_t order)
+{
+	if (order > LAST_ORDER) {
+		return page_allocator_error::order_out_of_range;
+	}
+
+	if (!block_aligned(order, block_start)) {
+		return page_allocator_error::page_not_aligned_with_order;
+	}
+
+	if (descriptor(block_start).state_ == page_state::free) {
+		panic("buddy: pfn %lx freed while already free", block_start);
+	}
+
+	insert_free_block(order, block_start);
+	free_pages_ += pages_per_block(order);
+
+	while (order < LAST_ORDER && is_free_block(order, buddy_of(order, block_start))) {
+		block_start = merge_buddies(order, block_start);
+		order++;
+	}
+
+	return page_allocator_error::none;
+}
+
+/**
+ * @brief Inserts pages that are known to be free into the buddy allocator.
  *
  * @param range_start The first page in the range.
  * @param page_count The number of pages in the range.
  */
-void page_allocator_buddy::insert_free_pages(pfn_t range_start, u64 page_count) { panic("TODO"); }
+void page_allocator_buddy::insert_free_pages(pfn_t range_start, u64 page_count)
+{
+	unique_irq_lock l(lock_);
+
+	if (range_start + page_count > pfn_limit_) {
+		pfn_limit_ = range_start + page_count;
+	}
+
+	total_pages_ += page_count;
+
+	// Carve the range into the largest naturally aligned blocks that fit, and free each one, so
+	// that they merge with anything already in the allocator.
+	while (page_count) {
+		order_t order = range_start ? __builtin_ctzll(range_start) : LAST_ORDER;
+		if (order > LAST_ORDER) {
+			order = LAST_ORDER;
+		}
+
+		while (pages_per_block(order) > page_count) {
+			order--;
+		}
+
+		// These pages have never been through the allocator before, so their descriptors could
+		// say anything.
+		descriptor(range_start).state_ = page_state::allocated;
+		free_block(range_start, order);
+
+		range_start += pages_per_block(order);
+		page_count -= pages_per_block(order);
+	}
+}
 
 /**
  * @brief Allocates pages, using the buddy algorithm.
  *
- * ** You are required to implement this function **
  * @param order The order of pages to allocate (i.e. 2^order number of pages)
  * @param flags Any allocation flags to take into account.
  * @return page* The starting page of the block that was allocated, or nullptr if the allocation cannot be satisfied.
  */
-page_allocation_result page_allocator_buddy::allocate_pages(order_t order, page_allocation_flags flags) { panic("TODO"); }
+page_allocation_result page_allocator_buddy::allocate_pages(order_t order, page_allocation_flags flags)
+{
+	if (order > LAST_ORDER) {
+		return page_allocation_result::error(page_allocator_error::order_out_of_range);
+	}
+
+	unique_irq_lock l(lock_);
+
+	pfn_t block = allocate_block(order);
+	if (block == INVALID_PFN) {
+		return page_allocation_result::error(page_allocator_error::out_of_memory);
+	}
+
+	l.unlock();
+
+	// The pages are ours now, so there's no need to hold the lock while clearing them.
+	if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(descriptor(block).base_address_ptr(), pages_per_block(order));
+	}
+
+	return page_allocation_result::ok(block);
+}
 
 /**
  * @brief Frees previously allocated pages, using the buddy algorithm.
  *
- * ** You are required to implement this function **
  * @param block_start The starting page of the block to be freed.
  * @param order The order of the block being freed.
  */
-page_allocator_error page_allocator_buddy::free_pages(pfn_t range_start, order_t order) { panic("TODO"); }
+page_allocator_error page_allocator_buddy::free_pages(pfn_t range_start, order_t order)
+{
+	unique_irq_lock l(lock_);
+	return free_block(range_start, order);
+}
 
-/**
- * @brief Returns the current state of the page allocator.
- *
- * ** You are required to implement this function **
- * @return page_allocator_stats A structure containing the state of the allocator.
- */
-page_allocator_stats page_allocator_buddy::get_stats() const { panic("TODO"); }
+u64 page_allocator_buddy::allocate_batch(order_t order, pfn_t *blocks, u64 count)
+{
+	if (order > LAST_ORDER) {
+		return 0;
+	}
+
+	unique_irq_lock l(lock_);
+
+	for (u64 i = 0; i < count; i++) {
+		blocks[i] = allocate_block(order);
+		if (blocks[i] == INVALID_PFN) {
+			return i;
+		}
+	}
+
+	return count;
+}
+
+u64 page_allocator_buddy::free_batch(order_t order, const pfn_t *blocks, u64 count)
+{
+	unique_irq_lock l(lock_);
+
+	for (u64 i = 0; i < count; i++) {
+		if (free_block(blocks[i], order) != page_allocator_error::none) {
+			return i;
+		}
+	}
+
+	return count;
+}
@@ -18,40 +18,71 @@ struct page_metadata {
 
 static inline page_metadata *metadata(pfn_t pfn) { return (page_metadata *)page::get_from_pfn(pfn).base_address_ptr(); }
 
-void page_allocator_linear::insert_free_pages(pfn_t range_start, u64 page_count)
+/**
+ * Puts a range of pages onto the free list, which is kept in address order, merging it with the
+ * free blocks either side if they touch.  The lock must be held.
+ */
+void page_allocator_linear::insert_free_range(pfn_t range_start, u64 page_count)
 {
-	if (free_list_start_ == 0) {
-		free_list_start_ = range_start;
-		metadata(free_list_start_)->next_free = 0;
-		metadata(free_list_start_)->free_block_size = page_count;
-	} else {
-		pfn_t current_free_block = free_list_start_;
+	pfn_t prev = 0;
+	pfn_t next = free_list_start_;
 
-		do {
-			pfn_t next_free_block = metadata(current_free_block)->next_free;
-			if (next_free_block == 0) {
-				break;
-			}
+	// Find the free blocks that this range sits between.
+	while (next && next < range_start) {
+		prev = next;
+		next = metadata(next)->next_free;
+	}
 
-			current_free_block = next_free_block;
-		} while (1);
+	if (prev && prev + metadata(prev)->free_block_size > range_start) {
+		panic("linear: pages %lx--%lx overlap free block at %lx", range_start, range_start + page_count, prev);
+	}
 
-		metadata(current_free_block)->next_free = range_start;
-		metadata(range_start)->next_free = 0;
+	if (next && range_start + page_count > next) {
+		panic("linear: pages %lx--%lx overlap free block at %lx", range_start, range_start + page_count, next);
+	}
+
+	// If the range runs right up to the next free block, absorb that block into it.
+	if (next && range_start + page_count == next) {
+		page_count += metadata(next)->free_block_size;
+		next = metadata(next)->next_free;
+	}
+
+	if (prev && prev + metadata(prev)->free_block_size == range_start) {
+		// The previous free block ends where this range starts, so just grow it.
+		metadata(prev)->free_block_size += page_count;
+		metadata(prev)->next_free = next;
+	} else {
 		metadata(range_start)->free_block_size = page_count;
+		metadata(range_start)->next_free = next;
+
+		if (prev) {
+			metadata(prev)->next_free = range_start;
+		} else {
+			free_list_start_ = range_start;
+		}
 	}
+}
+
+void page_allocator_linear::insert_free_pages(pfn_t range_start, u64 page_count)
+{
+	unique_irq_lock l(lock_);
+
+	insert_free_range(range_start, page_count);
 
 	total_pages_ += page_count;
 	free_pages_ += page_count;
 }
 
-page_allocation_result page_allocator_linear::allocate_pages(order_t order, page_allocation_flags flags)
+/**
+ * Carves a block of 2^order pages off the end of the first free block that is big enough.  The
+ * lock must be held.  Returns zero if there's no such free block.
+ */
+pfn_t page_allocator_linear::take_block(order_t order)
 {
 	u64 page_count = 1 << order;
 
 	// find a free block with enough pages
 	// take from the end, so we can just reduce the free block size
-
 	pfn_t free_block = free_list_start_;
 
 	while (free_block) {
@@ -60,22 +91,59 @@ page_allocation_result page_allocator_linear::allocate_pages(order_t order, page
 		// of the free block.
 		if ((metadata(free_block)->free_block_size - 1) >= page_count) {
 			metadata(free_block)->free_block_size -= page_count;
+			free_pages_ -= page_count;
 
-			u64 start_pfn = free_block + metadata(free_block)->free_block_size;
-			if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
-				memops::pzero(page::get_from_pfn(start_pfn).base_address_ptr(), page_count);
-			}
-
-			return page_allocation_result::ok(start_pfn);
+			return free_block + metadata(free_block)->free_block_size;
 		}
 
 		free_block = metadata(free_block)->next_free;
 	}
 
-	return page_allocation_result::error(page_allocator_error::out_of_memory);
+	return 0;
 }
 
-page_allocator_error page_allocator_linear::free_pages(pfn_t range_start, order_t order) { return page_allocator_error::not_implemented; }
+page_allocation_result page_allocator_linear::allocate_pages(order_t order, page_allocation_flags flags)
+{
+	unique_irq_lock l(lock_);
+
+	pfn_t start_pfn = take_block(order);
+	if (!start_pfn) {
+		return page_allocation_result::error(page_allocator_error::out_of_memory);
+	}
+
+	l.unlock();
+
+	// The pages are ours now, so there's no need to hold the lock while clearing them.
+	if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(page::get_from_pfn(start_pfn).base_address_ptr(), 1 << order);
+	}
+
+	return page_allocation_result::ok(start_pfn);
+}
+
+u64 page_allocator_linear::allocate_batch(order_t order, pfn_t *blocks, u64 count)
+{
+	unique_irq_lock l(lock_);
+
+	for (u64 i = 0; i < count; i++) {
+		blocks[i] = take_block(order);
+		if (!blocks[i]) {
+			return i;
+		}
+	}
+
+	return count;
+}
+
+page_allocator_error page_allocator_linear::free_pages(pfn_t range_start, order_t order)
+{
+	unique_irq_lock l(lock_);
+
+	insert_free_range(range_start, 1 << order);
+	free_pages_ += 1 << order;
+
+	return page_allocator_error::none;
+}
 
 void page_allocator_linear::dump() const
 {
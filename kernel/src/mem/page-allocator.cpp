@@ -10,6 +10,43 @@
 
 using namespace stacsos::kernel::mem;
 
+/**
+ * @brief Allocates up to count blocks of the given order, storing their starting PFNs in blocks.
+ * Allocators that can hand out several blocks more cheaply than one at a time (e.g. by taking
+ * their lock once) should override this.
+ *
+ * @return u64 The number of blocks actually allocated.
+ */
+u64 page_allocator::allocate_batch(order_t order, pfn_t *blocks, u64 count)
+{
+	for (u64 i = 0; i < count; i++) {
+		auto r = allocate_pages(order);
+		if (r.is_error()) {
+			return i;
+		}
+
+		blocks[i] = r.get_range_start();
+	}
+
+	return count;
+}
+
+/**
+ * @brief Frees count blocks of the given order.  Stops at the first block that can't be freed.
+ *
+ * @return u64 The number of blocks actually freed (from the start of blocks).
+ */
+u64 page_allocator::free_batch(order_t order, const pfn_t *blocks, u64 count)
+{
+	for (u64 i = 0; i < count; i++) {
+		if (free_pages(blocks[i], order) != page_allocator_error::none) {
+			return i;
+		}
+	}
+
+	return count;
+}
+
 void page_allocator::perform_selftest()
 {
 	dprintf("******************************************\n");
@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/irq-flags.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-frame-cache.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::mem;
+
+// The caches are strictly per-core, so rather than a lock, we just need to stop ourselves being
+// interrupted (and so possibly rescheduled onto another core) while we're using one, with
+// local_irq_save/local_irq_restore.
+
+page_allocation_result page_frame_cache::allocate_pages(order_t order, page_allocation_flags flags)
+{
+	if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero && order < nr_zeroed_orders) {
+		pfn_t block = take_zeroed_block(order);
+		if (block != 0) {
+			return page_allocation_result::ok(block);
+		}
+	}
+
+	if (order >= nr_cached_orders) {
+		auto r = backing_.allocate_pages(order, flags);
+
+		// If we're out of memory, see if anyone is sitting on some, and try again if so.
+		if (r.is_error() && reclaim(flags)) {
+			return allocate_pages(order, flags);
+		}
+
+		return r;
+	}
+
+	u64 irq_flags = local_irq_save();
+
+	order_cache &oc = caches_[core::this_core_id()].orders[order];
+	if (oc.count == 0 && !refill(oc, order)) {
+		local_irq_restore(irq_flags);
+
+		// The backing allocator couldn't give us a batch, but it may still have a single block
+		// (or report a more useful error), so let it have the final say.
+		auto r = backing_.allocate_pages(order, flags);
+		if (r.is_error() && reclaim(flags)) {
+			return allocate_pages(order, flags);
+		}
+
+		return r;
+	}
+
+	pfn_t block = oc.blocks[--oc.count];
+	local_irq_restore(irq_flags);
+
+	// Cached blocks have been used before, so they're dirty.
+	if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(page::get_from_pfn(block).base_address_ptr(), 1 << order);
+	}
+
+	return page_allocation_result::ok(block);
+}
+
+page_allocator_error page_frame_cache::free_pages(pfn_t range_start, order_t order)
+{
+	if (order >= nr_cached_orders) {
+		return backing_.free_pages(range_start, order);
+	}
+
+	if (range_start & ((1 << order) - 1)) {
+		return page_allocator_error::page_not_aligned_with_order;
+	}
+
+	u64 irq_flags = local_irq_save();
+
+	order_cache &oc = caches_[core::this_core_id()].orders[order];
+	if (oc.count >= high_watermark(order)) {
+		drain(oc, order, batch_size(order));
+
+		// If the backing allocator wouldn't take anything back, then we've nowhere to put the
+		// block.
+		if (oc.count >= high_watermark(order)) {
+			local_irq_restore(irq_flags);
+			return backing_.free_pages(range_start, order);
+		}
+	}
+
+	oc.blocks[oc.count++] = range_start;
+	local_irq_restore(irq_flags);
+
+	return page_allocator_error::none;
+}
+
+/**
+ * @brief Tops up an empty per-core cache with a batch of blocks from the backing allocator.
+ * Interrupts must be disabled.
+ *
+ * @return true if at least one block was obtained.
+ */
+bool page_frame_cache::refill(order_cache &oc, order_t order)
+{
+	oc.count = backing_.allocate_batch(order, oc.blocks, batch_size(order));
+	return oc.count > 0;
+}
+
+/**
+ * @brief Returns up to count blocks from the bottom (i.e. the coldest end) of a per-core cache to
+ * the backing allocator.  Interrupts must be disabled.
+ */
+void page_frame_cache::drain(order_cache &oc, order_t order, u64 count)
+{
+	if (count > oc.count) {
+		count = oc.count;
+	}
+
+	u64 drained = backing_.free_batch(order, oc.blocks, count);
+	if (drained == 0) {
+		return;
+	}
+
+	for (u64 i = drained; i < oc.count; i++) {
+		oc.blocks[i - drained] = oc.blocks[i];
+	}
+
+	oc.count -= drained;
+}
+
+/**
+ * @brief Takes a pre-zeroed block of the given order from the shared pool.
+ *
+ * @return pfn_t The starting page of the block, or zero if the pool is empty.
+ */
+pfn_t page_frame_cache::take_zeroed_block(order_t order)
+{
+	unique_irq_lock l(zeroed_lock_);
+
+	order_cache &pool = zeroed_[order];
+	if (pool.count == 0) {
+		return 0;
+	}
+
+	return pool.blocks[--pool.count];
+}
+
+/**
+ * @brief Hands every pre-zeroed block back to the backing allocator, for when memory is tight.
+ *
+ * @return true if any blocks were released.
+ */
+bool page_frame_cache::release_zeroed_blocks()
+{
+	unique_irq_lock l(zeroed_lock_);
+
+	bool released = false;
+	for (order_t order = 0; order < nr_zeroed_orders; order++) {
+		order_cache &pool = zeroed_[order];
+		if (pool.count == 0) {
+			continue;
+		}
+
+		u64 freed = backing_.free_batch(order, pool.blocks, pool.count);
+		for (u64 i = freed; i < pool.count; i++) {
+			pool.blocks[i - freed] = pool.blocks[i];
+		}
+
+		pool.count -= freed;
+		released |= freed > 0;
+	}
+
+	return released;
+}
+
+/**
+ * @brief Tries to find some memory, after an allocation has failed: if the allocation flags allow it,
+ * the rest of the kernel is asked to give back what it can, and then the zeroed pool and this core's
+ * caches are handed back to the backing allocator.
+ *
+ * @return true if anything was released, i.e. it's worth trying the allocation again.
+ */
+bool page_frame_cache::reclaim(page_allocation_flags flags)
+{
+	bool released = false;
+
+	// The rest of the kernel is only asked if the caller holds no locks, as giving memory back may
+	// mean waiting for other cores.  Do this first, as any slabs it frees will land in this core's
+	// cache.
+	if ((flags & page_allocation_flags::reclaim) == page_allocation_flags::reclaim) {
+		released = mm().reclaim_memory() > 0;
+	}
+
+	released |= release_zeroed_blocks();
+
+	u64 irq_flags = local_irq_save();
+
+	core_cache &cc = caches_[core::this_core_id()];
+	for (order_t order = 0; order < nr_cached_orders; order++) {
+		u64 before = cc.orders[order].count;
+		drain(cc.orders[order], order, before);
+		released |= cc.orders[order].count < before;
+	}
+
+	local_irq_restore(irq_flags);
+
+	return released;
+}
+
+/**
+ * @brief Zeroes one block for the pre-zeroed pool, if it needs topping up.  This is called from the
+ * idle loop with interrupts enabled, so it does a small, bounded amount of work each time, and
+ * doesn't mind being interrupted part way through.
+ *
+ * @return true if a block was zeroed, i.e. it's worth calling again.
+ */
+bool page_frame_cache::zero_idle_pages()
+{
+	// Find the lowest order that is short of zeroed blocks.
+	order_t order;
+	{
+		unique_irq_lock l(zeroed_lock_);
+
+		for (order = 0; order < nr_zeroed_orders; order++) {
+			if (zeroed_[order].count < zeroed_target(order)) {
+				break;
+			}
+		}
+	}
+
+	if (order == nr_zeroed_orders) {
+		return false;
+	}
+
+	// Leave plenty of memory for everyone else.
+	if (backing_.get_stats().free_pages < zeroing_reserve_pages + (1 << order)) {
+		return false;
+	}
+
+	auto r = backing_.allocate_pages(order);
+	if (r.is_error()) {
+		return false;
+	}
+
+	pfn_t block = r.get_range_start();
+	memops::pzero(page::get_from_pfn(block).base_address_ptr(), 1 << order);
+
+	unique_irq_lock l(zeroed_lock_);
+
+	order_cache &pool = zeroed_[order];
+	if (pool.count >= zeroed_target(order)) {
+		// Another core filled the pool while we were busy.
+		l.unlock();
+		backing_.free_pages(block, order);
+		return false;
+	}
+
+	pool.blocks[pool.count++] = block;
+	return true;
+}
+
+page_allocator_stats page_frame_cache::get_stats() const
+{
+	auto stats = backing_.get_stats();
+
+	// Blocks sitting in the per-core caches are free, as far as everyone else is concerned -- but
+	// the backing allocator counts them as used.  These counts can be slightly stale, which is fine
+	// for statistics.
+	u64 cached_pages = 0;
+	for (int core = 0; core < core_manager::max_cores; core++) {
+		for (order_t order = 0; order < nr_cached_orders; order++) {
+			cached_pages += caches_[core].orders[order].count << order;
+		}
+	}
+
+	for (order_t order = 0; order < nr_zeroed_orders; order++) {
+		cached_pages += zeroed_[order].count << order;
+	}
+
+	stats.used_pages -= cached_pages;
+	stats.free_pages += cached_pages;
+
+	return stats;
+}
+
+void page_frame_cache::dump() const
+{
+	dprintf("*** per-core page frame cache ***\n");
+
+	for (int core = 0; core < core_manager::max_cores; core++) {
+		const core_cache &cc = caches_[core];
+
+		u64 total = 0;
+		for (order_t order = 0; order < nr_cached_orders; order++) {
+			total += cc.orders[order].count;
+		}
+
+		if (total == 0) {
+			continue;
+		}
+
+		dprintf("  core %d:", core);
+		for (order_t order = 0; order < nr_cached_orders; order++) {
+			dprintf(" [%u]=%lu", order, cc.orders[order].count);
+		}
+		dprintf("\n");
+	}
+
+	dprintf("  zeroed:");
+	for (order_t order = 0; order < nr_zeroed_orders; order++) {
+		dprintf(" [%u]=%lu", order, zeroed_[order].count);
+	}
+	dprintf("\n");
+
+	backing_.dump();
+}
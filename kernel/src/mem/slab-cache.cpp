@@ -12,16 +12,57 @@
 
 using namespace stacsos::kernel::mem;
 
-template <size_t object_size, int slab_page_order> void *slab_cache<object_size, slab_page_order>::allocate_slab()
+void *slab_cache_base::allocate_slab(int order)
 {
-	page &slab_page = memory_manager::get().pgalloc().allocate_pages(slab_page_order).to_page();
-	return slab_page.base_address_ptr();
+	page &slab_page = memory_manager::get().pgalloc().allocate_pages(order).to_page();
+	void *slab_base = slab_page.base_address_ptr();
+
+	// Point every page of the slab back at it, so that objects can be freed in constant time.
+	for (pfn_t pfn = slab_page.pfn(); pfn < slab_page.pfn() + (1 << order); pfn++) {
+		page::get_from_pfn(pfn).set_slab(this, slab_base);
+	}
+
+	return slab_base;
+}
+
+void slab_cache_base::release_slab(void *slab_base, int order)
+{
+	page &slab_page = page::get_from_base_address(virt_to_phys(slab_base));
+
+	for (pfn_t pfn = slab_page.pfn(); pfn < slab_page.pfn() + (1 << order); pfn++) {
+		page::get_from_pfn(pfn).set_slab(nullptr, nullptr);
+	}
+
+	memory_manager::get().pgalloc().free_pages(slab_page.pfn(), order);
+}
+
+/**
+ * Frees an object that was allocated from any slab cache, by looking up its owner in the page
+ * descriptor.
+ */
+void slab_cache_base::free_object(void *ptr)
+{
+	page &pg = page::get_from_base_address(virt_to_phys(ptr));
+
+	slab_cache_base *cache = pg.slab_cache();
+	if (!cache) {
+		panic("unable to free object %p: not in a slab", ptr);
+	}
+
+	cache->free(pg.slab(), ptr);
 }
 
 template class slab_cache<16, 0>;
 template class slab_cache<32, 0>;
+template class slab_cache<48, 0>;
 template class slab_cache<64, 0>;
+template class slab_cache<96, 0>;
 template class slab_cache<128, 0>;
+template class slab_cache<192, 0>;
 template class slab_cache<256, 0>;
+template class slab_cache<384, 0>;
 template class slab_cache<512, 0>;
-template class slab_cache<1024, 0>;
+template class slab_cache<768, 1>;
+template class slab_cache<1024, 1>;
+template class slab_cache<2048, 2>;
+template class slab_cache<4096, 3>;
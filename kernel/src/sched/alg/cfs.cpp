@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/sched/alg/cfs.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+using namespace stacsos::kernel::arch::x86;
+
+// The most virtual runtime (in milliseconds) that a task joining the runqueue can be credited with.
+// This lets tasks that spend most of their time asleep (e.g. interactive ones) run promptly when they
+// wake up, without letting them monopolise the core.
+static const u64 sleeper_credit_ms = 3;
+
+static s64 sleeper_credit() { return (s64)((x86_core::this_core().local_tsc().frequency() * sleeper_credit_ms) / 1000); }
+
+static bool can_steal(const tcb *tcb, int thief_core_id) { return !tcb->live && tcb->entity->can_run_on(thief_core_id); }
+
+void completely_fair_scheduler::enqueue(tcb &tcb) { timeline_.add(key { tcb.vruntime, &tcb }, &tcb); }
+
+void completely_fair_scheduler::dequeue(tcb &tcb) { timeline_.remove(key { tcb.vruntime, &tcb }); }
+
+/**
+ * Chooses the virtual runtime for a task joining this runqueue.  A task's lag (how far it was
+ * from the minimum virtual runtime when it left a runqueue) is preserved, so placement doesn't
+ * depend on which core the task came from.  Time spent away from the runqueue is credited, up to
+ * the sleeper credit limit.
+ */
+void completely_fair_scheduler::place(tcb &tcb)
+{
+	s64 lag = tcb.vlag;
+
+	u64 now = __builtin_ia32_rdtsc();
+	if (tcb.stop_time != 0 && now > tcb.stop_time) {
+		lag -= (s64)(now - tcb.stop_time);
+	}
+
+	s64 credit = sleeper_credit();
+	if (lag < -credit) {
+		lag = -credit;
+	}
+
+	if (lag < 0 && (u64)-lag > min_vruntime_) {
+		tcb.vruntime = 0;
+	} else {
+		tcb.vruntime = min_vruntime_ + lag;
+	}
+}
+
+/**
+ * Charges the running task for the time it has been running since it was last accounted.
+ */
+void completely_fair_scheduler::update_current()
+{
+	if (!current_) {
+		return;
+	}
+
+	// Higher priority tasks (i.e. those with a larger weight) accrue virtual runtime more slowly.
+	u64 delta = current_->run_time - current_run_time_base_;
+	current_->vruntime += (delta * schedulable_entity::default_weight) / current_->entity->weight();
+	current_run_time_base_ = current_->run_time;
+}
+
+/**
+ * Advances the cached minimum virtual runtime, which never goes backwards.
+ */
+void completely_fair_scheduler::update_min_vruntime()
+{
+	u64 vruntime = min_vruntime_;
+	bool valid = false;
+
+	if (current_ && current_queued_) {
+		vruntime = current_->vruntime;
+		valid = true;
+	}
+
+	auto leftmost = timeline_.first();
+	if (leftmost) {
+		vruntime = valid ? min(vruntime, leftmost->key().vruntime) : leftmost->key().vruntime;
+		valid = true;
+	}
+
+	if (valid) {
+		min_vruntime_ = max(min_vruntime_, vruntime);
+	}
+}
+
+void completely_fair_scheduler::add_to_runqueue(tcb &tcb)
+{
+	// The running task may leave the runqueue and come back before it has been switched away
+	// from, in which case it's never been taken out of the tree.
+	if (&tcb == current_) {
+		current_queued_ = true;
+		return;
+	}
+
+	place(tcb);
+	enqueue(tcb);
+}
+
+void completely_fair_scheduler::remove_from_runqueue(tcb &tcb)
+{
+	// The running task isn't in the tree, and is accounted for when it is switched away from.
+	if (&tcb == current_) {
+		current_queued_ = false;
+		return;
+	}
+
+	dequeue(tcb);
+	tcb.vlag = (s64)(tcb.vruntime - min_vruntime_);
+}
+
+void completely_fair_scheduler::put_current()
+{
+	// Put the running task back into the tree (if it's still runnable), so that it competes with
+	// everything else.
+	if (current_) {
+		update_current();
+
+		if (current_queued_) {
+			enqueue(*current_);
+		} else {
+			current_->vlag = (s64)(current_->vruntime - min_vruntime_);
+		}
+
+		current_ = nullptr;
+	}
+}
+
+tcb *completely_fair_scheduler::select_next_task(tcb *current)
+{
+	put_current();
+	update_min_vruntime();
+
+	auto leftmost = timeline_.first();
+	if (!leftmost) {
+		return nullptr;
+	}
+
+	tcb *next = leftmost->data();
+	dequeue(*next);
+
+	current_ = next;
+	current_queued_ = true;
+	current_run_time_base_ = next->run_time;
+
+	return next;
+}
+
+tcb *completely_fair_scheduler::select_task_to_steal(int thief_core_id)
+{
+	// Prefer the task that would run last here.  The running task isn't in the tree, but the one
+	// that was just switched away from may still be live.
+	auto rightmost = timeline_.last();
+	if (rightmost && can_steal(rightmost->data(), thief_core_id)) {
+		return rightmost->data();
+	}
+
+	for (const auto &candidate : timeline_) {
+		if (can_steal(candidate.value, thief_core_id)) {
+			return candidate.value;
+		}
+	}
+
+	return nullptr;
+}
+
+u64 completely_fair_scheduler::time_slice(u64 quantum, u64 nr_runnable) const
+{
+	// Every runnable task should get a turn within a period of two quanta, but don't let the
+	// slices get so small that we spend all our time switching.
+	u64 period = quantum * 2;
+	u64 min_slice = quantum / 4;
+
+	if (nr_runnable == 0) {
+		return period;
+	}
+
+	return max(period / nr_runnable, min_slice);
+}
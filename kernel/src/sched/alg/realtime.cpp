@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/alg/realtime.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+
+void realtime_scheduler::add_to_runqueue(tcb &tcb)
+{
+	int priority = tcb.entity->priority();
+
+	queues_[priority].append(&tcb);
+	active_ |= (1u << priority);
+}
+
+void realtime_scheduler::remove_from_runqueue(tcb &tcb)
+{
+	int priority = tcb.entity->priority();
+
+	queues_[priority].remove(&tcb);
+	if (queues_[priority].empty()) {
+		active_ &= ~(1u << priority);
+	}
+}
+
+tcb *realtime_scheduler::select_next_task(tcb *current)
+{
+	if (empty()) {
+		return nullptr;
+	}
+
+	auto &queue = queues_[highest_priority()];
+
+	// If the running task is at the front of the highest priority queue, then it's either used up
+	// its time slice or yielded, so give the next task at the same priority a turn.
+	if (queue.count() > 1 && queue.first() == current) {
+		queue.rotate();
+	}
+
+	return queue.first();
+}
+
+tcb *realtime_scheduler::select_task_to_steal(int thief_core_id)
+{
+	// Real-time tasks are stolen highest priority first, because they're the ones that are
+	// waiting on a busy core for the least good reason.
+	for (int priority = nr_priorities - 1; priority >= 0; priority--) {
+		for (auto *task : queues_[priority]) {
+			if (!task->live && task->entity->can_run_on(thief_core_id)) {
+				return task;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+bool realtime_scheduler::should_preempt(const tcb *current) const
+{
+	if (empty()) {
+		return false;
+	}
+
+	if (!current || !current->entity || current->entity->policy() != sched_policy::realtime) {
+		return true;
+	}
+
+	return highest_priority() > current->entity->priority();
+}
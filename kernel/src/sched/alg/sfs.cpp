@@ -12,6 +12,9 @@
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::sched::alg;
 
+// Runtime scaled by the task's weight, so that higher priority tasks look like they've had less.
+static u64 weighted_run_time(const tcb *thread) { return (thread->run_time * schedulable_entity::default_weight) / thread->entity->weight(); }
+
 tcb *simple_fair_scheduler::select_next_task(tcb *current)
 {
 	if (runqueue_.empty()) {
@@ -26,8 +29,28 @@ tcb *simple_fair_scheduler::select_next_task(tcb *current)
 	tcb *candidate = nullptr;
 
 	for (auto *thread : runqueue_) {
-		if (candidate == nullptr || (thread->run_time < min_runtime)) {
-			min_runtime = thread->run_time;
+		u64 runtime = weighted_run_time(thread);
+		if (candidate == nullptr || (runtime < min_runtime)) {
+			min_runtime = runtime;
+			candidate = thread;
+		}
+	}
+
+	return candidate;
+}
+
+tcb *simple_fair_scheduler::select_task_to_steal(int thief_core_id)
+{
+	// Give away the task that has had the most runtime, as it's the one this runqueue
+	// would get around to last.
+	tcb *candidate = nullptr;
+
+	for (auto *thread : runqueue_) {
+		if (thread->live || !thread->entity->can_run_on(thief_core_id)) {
+			continue;
+		}
+
+		if (candidate == nullptr || thread->run_time > candidate->run_time) {
 			candidate = thread;
 		}
 	}
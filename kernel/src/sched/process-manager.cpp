@@ -12,6 +12,7 @@
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/vfs.h>
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/sched/process-manager.h>
 #include <stacsos/kernel/sched/thread.h>
 
@@ -22,6 +23,37 @@ using namespace stacsos::kernel::arch;
 
 void process_manager::init() { dprintf("processes: init\n"); }
 
+/**
+ * Frees the memory of one process that has terminated.  This runs in the idle loop, as it has to wait
+ * until the process's threads have left every core, and when memory is short.  It mustn't be called
+ * with any locks held.  Returns true if there was one to free.
+ */
+bool process_manager::reap_terminated_process()
+{
+	address_space *vma = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// The process itself stays on the list: only its memory goes.  It's claimed under the lock, so
+		// that another reaper can't pick the same process.
+		for (auto &p : active_processes_) {
+			vma = p->claim_memory();
+			if (vma) {
+				break;
+			}
+		}
+	}
+
+	if (!vma) {
+		return false;
+	}
+
+	// Freeing the address space shoots down TLB entries, so must be done without the lock held.
+	delete vma;
+	return true;
+}
+
 shared_ptr<process> process_manager::create_kernel_process(continuation_fn cfn)
 {
 	if (kernel_process_) {
@@ -32,23 +64,23 @@ shared_ptr<process> process_manager::create_kernel_process(continuation_fn cfn)
 	kernel_process->create_thread((u64)cfn);
 
 	auto kernel_process_ptr = shared_ptr(kernel_process);
-	active_processes_.append(kernel_process_ptr);
+
+	{
+		unique_irq_lock l(lock_);
+		active_processes_.append(kernel_process_ptr);
+	}
 
 	kernel_process_ = kernel_process_ptr;
 	return kernel_process_ptr;
 }
 
-shared_ptr<process> process_manager::create_process(const char *path, const char *args)
+/**
+ * Loads an ELF binary into a new address space, returning the address space and the entry point, or
+ * nullptr if the binary can't be loaded.
+ */
+address_space *process_manager::load_image(fs::fs_node &binary, u64 &entry_point)
 {
-	auto *binary = stacsos::kernel::fs::vfs::get().lookup(path);
-	if (!binary) {
-		dprintf("pm: binary '%s' not found\n", path);
-		return nullptr;
-	}
-
-	dprintf("pm: found binary '%s'\n", path);
-
-	auto file = binary->open();
+	auto file = binary.open();
 	if (!file) {
 		dprintf("pm: unable to open binary\n");
 		return nullptr;
@@ -67,12 +99,7 @@ shared_ptr<process> process_manager::create_process(const char *path, const char
 
 	const elf_header<64> *ehdr = (const elf_header<64> *)header_buffer;
 
-	// parse elf file
-	// create process
-	// load address space
-	// create main thread
-
-	auto proc = new process(exec_privilege::user);
+	auto image = memory_manager::get().root_address_space().create_linked(process::user_region_base);
 
 	char *program_headers = new char[ehdr->e_phnum * ehdr->e_phentsize];
 	file->pread(program_headers, ehdr->e_phoff, ehdr->e_phnum * ehdr->e_phentsize);
@@ -88,7 +115,14 @@ shared_ptr<process> process_manager::create_process(const char *path, const char
 			u64 vaddr_page_offset = phdr->p_vaddr & ~PAGE_MASK;
 			u64 size = (phdr->p_memsz + vaddr_page_offset + (PAGE_SIZE - 1)) & PAGE_MASK;
 
-			auto rgn = proc->addrspace().add_region(vaddr_page, size, region_flags::all, true);
+			// Segments the binary doesn't write to (e.g. text and read-only data) are mapped read-only,
+			// so that every process started from the same template keeps sharing them for good.
+			region_flags flags = region_flags::readable | region_flags::executable;
+			if ((phdr->p_flags & elf_program_header_flags::pf_w) == elf_program_header_flags::pf_w) {
+				flags |= region_flags::writable;
+			}
+
+			auto rgn = image->add_region(vaddr_page, size, flags, true);
 			if (!rgn) {
 				panic("unable to add region for segment");
 			}
@@ -102,6 +136,77 @@ shared_ptr<process> process_manager::create_process(const char *path, const char
 
 	delete[] program_headers;
 
+	entry_point = ehdr->e_entry;
+	return image;
+}
+
+/**
+ * Returns a fresh copy of the process image for the given binary.  The first time a binary is started,
+ * it is loaded into a template address space, which is kept for as long as the system is up.  Every
+ * process started from the same binary after that gets a copy-on-write clone of the template, rather
+ * than reading and copying every segment from the file again.
+ */
+address_space *process_manager::instantiate_image(fs::fs_node &binary, u64 &entry_point)
+{
+	address_space *template_image = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+
+		for (const auto &tmpl : templates_) {
+			if (tmpl.binary == &binary) {
+				template_image = tmpl.image;
+				entry_point = tmpl.entry_point;
+				break;
+			}
+		}
+	}
+
+	// Templates are never freed, so it's safe to clone one without holding the lock.
+	if (template_image) {
+		return template_image->clone();
+	}
+
+	auto image = load_image(binary, entry_point);
+	if (!image) {
+		return nullptr;
+	}
+
+	{
+		unique_irq_lock l(lock_);
+
+		// If another process has loaded the same binary in the meantime, then it has provided the
+		// template, and the image just loaded can belong to the new process outright.
+		for (const auto &tmpl : templates_) {
+			if (tmpl.binary == &binary) {
+				return image;
+			}
+		}
+
+		templates_.append(process_template { &binary, image, entry_point });
+	}
+
+	return image->clone();
+}
+
+shared_ptr<process> process_manager::create_process(const char *path, const char *args)
+{
+	auto *binary = stacsos::kernel::fs::vfs::get().lookup(path);
+	if (!binary) {
+		dprintf("pm: binary '%s' not found\n", path);
+		return nullptr;
+	}
+
+	dprintf("pm: found binary '%s'\n", path);
+
+	u64 entry_point;
+	auto image = instantiate_image(*binary, entry_point);
+	if (!image) {
+		return nullptr;
+	}
+
+	auto proc = new process(exec_privilege::user, image);
+
 	auto data_page = proc->addrspace().alloc_region(0x1000, region_flags::readable, true);
 	if (!data_page) {
 		panic("unable to allocate data page");
@@ -109,10 +214,14 @@ shared_ptr<process> process_manager::create_process(const char *path, const char
 
 	memops::strncpy((char *)data_page->storage->base_address_ptr(), args, memops::strlen(args) + 1);
 
-	proc->create_thread(ehdr->e_entry, (void *)data_page->base);
+	proc->create_thread(entry_point, (void *)data_page->base);
 
 	auto pp = shared_ptr(proc);
-	active_processes_.append(pp);
+
+	{
+		unique_irq_lock l(lock_);
+		active_processes_.append(pp);
+	}
 
 	return pp;
 }
@@ -5,8 +5,10 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/mem/address-space.h>
 #include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/scheduler.h>
 #include <stacsos/kernel/sched/thread.h>
 
 using namespace stacsos;
@@ -17,17 +19,29 @@ shared_ptr<thread> process::create_thread(u64 entry_point, void *entry_arg)
 {
 	u64 user_stack = 0;
 	if (priv_ == exec_privilege::user) {
-		u64 stack_base = next_user_stack_;
+		u64 stack_base;
 		u64 stack_size = 0x4000;
 
-		next_user_stack_ += stack_size + 0x1000; // Allocate the stack size, but plus a "guard page".
+		{
+			unique_irq_lock l(threads_lock_);
+
+			stack_base = next_user_stack_;
+			next_user_stack_ += stack_size + 0x1000; // Allocate the stack size, but plus a "guard page".
+		}
 
 		user_stack = stack_base + stack_size;
-		addrspace().add_region(stack_base, stack_size, region_flags::readwrite, true);
+		addrspace().add_region(stack_base, stack_size, region_flags::readwrite, false);
 	}
 
 	shared_ptr<thread> t = shared_ptr(new thread(*this, entry_point, entry_arg, user_stack));
-	threads_.append(t);
+
+	{
+		unique_irq_lock l(threads_lock_);
+
+		// The thread hasn't been started, so it can't be on a runqueue yet.
+		t->set_affinity(affinity_);
+		threads_.append(t);
+	}
 
 	return t;
 }
@@ -52,6 +66,26 @@ void process::stop()
 	state_changed_event_.trigger();
 }
 
+/**
+ * Restricts this process, and all of its existing threads, to the given set of cores.  Returns
+ * false if the set doesn't contain any online cores.
+ */
+bool process::set_affinity(u64 affinity)
+{
+	if ((affinity & scheduler::get().online_cores()) == 0) {
+		return false;
+	}
+
+	unique_irq_lock l(threads_lock_);
+
+	affinity_ = affinity;
+	for (auto &t : threads_) {
+		scheduler::get().set_affinity(*t.get(), affinity);
+	}
+
+	return true;
+}
+
 void process::on_thread_stopped(thread &thread)
 {
 	// dprintf("proc: thread stopped\n");
@@ -71,3 +105,44 @@ void process::on_thread_stopped(thread &thread)
 	state_ = process_state::terminated;
 	state_changed_event_.trigger();
 }
+
+/**
+ * Whether this process has terminated, and none of its threads can be running in its address space any
+ * more, so that the address space can be freed.
+ */
+bool process::can_release_memory()
+{
+	if (priv_ == exec_privilege::kernel || state_ != process_state::terminated || vma_ == nullptr) {
+		return false;
+	}
+
+	{
+		unique_irq_lock l(threads_lock_);
+
+		for (auto &t : threads_) {
+			if (t->state() != thread_states::terminated) {
+				return false;
+			}
+		}
+	}
+
+	// A thread that has just stopped may still be on its way out on some core.
+	return !arch::x86::x86_core::is_address_space_active(vma_->pgtable().effective_cr3());
+}
+
+/**
+ * Takes the address space away from this process, if can_release_memory() says it's safe to, so
+ * that the caller can free it.  This must be called with the process manager's lock held, so that
+ * only one caller ever gets the address space.
+ */
+address_space *process::claim_memory()
+{
+	if (!can_release_memory()) {
+		return nullptr;
+	}
+
+	address_space *vma = vma_;
+	vma_ = nullptr;
+
+	return vma;
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/alg/realtime.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::sched;
+
+// Weights for each fair-share priority, from -20 to 19.  Each step is worth roughly 10% of the
+// processor relative to a task one step away, and priority 0 has the default weight.
+static const u64 fair_priority_weights[] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548, 7620, 6100, 4904, 3906,
+	/*  -5 */ 3121, 2501, 1991, 1586, 1277,
+	/*   0 */ 1024, 820, 655, 526, 423,
+	/*   5 */ 335, 272, 215, 172, 137,
+	/*  10 */ 110, 87, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15,
+};
+
+bool schedulable_entity::is_valid_priority(sched_policy policy, int priority)
+{
+	switch (policy) {
+	case sched_policy::fair:
+		return priority >= min_fair_priority && priority <= max_fair_priority;
+
+	case sched_policy::realtime:
+		return priority >= 0 && priority < alg::realtime_scheduler::nr_priorities;
+
+	default:
+		return false;
+	}
+}
+
+void schedulable_entity::set_priority(sched_policy policy, int priority)
+{
+	if (!is_valid_priority(policy, priority)) {
+		panic("invalid priority %d", priority);
+	}
+
+	policy_ = policy;
+	priority_ = priority;
+
+	if (policy == sched_policy::fair) {
+		weight_ = fair_priority_weights[priority - min_fair_priority];
+	} else {
+		weight_ = default_weight;
+	}
+}
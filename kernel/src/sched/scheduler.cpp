@@ -13,8 +13,112 @@
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::arch;
 
-// TODO: support multicore.
+/**
+ * Chooses the core that a newly runnable entity should be queued on.
+ */
+core &scheduler::select_core(schedulable_entity &e)
+{
+	core *owner = e.owning_core();
+
+	// If the entity is still live on a core (e.g. it's just been suspended, but hasn't been switched
+	// away from yet), then it must go back to that core, because its stack is still in use there.
+	if (owner && e.get_tcb()->live) {
+		return *owner;
+	}
+
+	// Otherwise, pick the least loaded core that the entity is allowed to run on, preferring the one
+	// it last ran on, and then this one.
+	core *best = nullptr;
+	if (owner && owner->is_online() && e.can_run_on(owner->id())) {
+		best = owner;
+	} else if (e.can_run_on(core::this_core_id())) {
+		best = &core::this_core();
+	}
+
+	for (auto *c : core_manager::get().cores()) {
+		if (c->is_online() && e.can_run_on(c->id()) && (best == nullptr || c->nr_runnable() < best->nr_runnable())) {
+			best = c;
+		}
+	}
+
+	// The affinity mask is checked against the online cores when it is set, so this shouldn't happen.
+	if (!best) {
+		panic("no core available for entity with affinity %lx", e.affinity());
+	}
+
+	return *best;
+}
+
+void scheduler::add_to_schedule(schedulable_entity &e) { select_core(e).add_to_runqueue(*e.get_tcb()); }
+
+void scheduler::remove_from_schedule(schedulable_entity &e)
+{
+	// The entity may be migrated between reading its owner and taking the owner's runqueue lock, in
+	// which case try again with the new owner.
+	core *owner;
+	while ((owner = e.owning_core()) != nullptr) {
+		if (owner->remove_from_runqueue(*e.get_tcb())) {
+			break;
+		}
+	}
+}
+
+/**
+ * Changes the scheduling policy and priority of an entity.  Returns false if the priority isn't
+ * valid for the policy.
+ */
+bool scheduler::set_priority(schedulable_entity &e, sched_policy policy, int priority)
+{
+	if (!schedulable_entity::is_valid_priority(policy, priority)) {
+		return false;
+	}
+
+	// The entity can only be moved between scheduling algorithms by the core that owns it.  If it
+	// has never been scheduled, there's nothing to move.
+	core *owner;
+	while ((owner = e.owning_core()) != nullptr) {
+		if (owner->set_task_priority(*e.get_tcb(), policy, priority)) {
+			return true;
+		}
+	}
+
+	e.set_priority(policy, priority);
+	return true;
+}
+
+/**
+ * Returns the set of cores that are currently online, as an affinity mask.
+ */
+u64 scheduler::online_cores() const
+{
+	u64 mask = 0;
+
+	for (auto *c : core_manager::get().cores()) {
+		if (c->is_online()) {
+			mask |= 1ull << c->id();
+		}
+	}
+
+	return mask;
+}
+
+/**
+ * Restricts an entity to the given set of cores, moving it if it's queued on a core it may no
+ * longer run on.  Returns false if the set doesn't contain any online cores.
+ */
+bool scheduler::set_affinity(schedulable_entity &e, u64 affinity)
+{
+	if ((affinity & online_cores()) == 0) {
+		return false;
+	}
 
-void scheduler::add_to_schedule(schedulable_entity &e) { core_manager::get().get_core(0).add_to_runqueue(*e.get_tcb()); }
+	core *owner;
+	while ((owner = e.owning_core()) != nullptr) {
+		if (owner->set_task_affinity(*e.get_tcb(), affinity)) {
+			return true;
+		}
+	}
 
-void scheduler::remove_from_schedule(schedulable_entity &e) { core_manager::get().get_core(0).remove_from_runqueue(*e.get_tcb()); }
+	e.set_affinity(affinity);
+	return true;
+}
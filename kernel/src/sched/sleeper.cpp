@@ -5,6 +5,8 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/timer.h>
+#include <stacsos/kernel/arch/x86/irq-flags.h>
 #include <stacsos/kernel/arch/x86/tsc.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
@@ -12,6 +14,7 @@
 #include <stacsos/kernel/sched/thread.h>
 
 using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
 
 void sleeper::sleep_ms(u64 duration_ms)
@@ -24,32 +27,52 @@ void sleeper::sleep_ms(u64 duration_ms)
 
 void sleeper::do_sleep(u64 wakeup_deadline)
 {
+	// Interrupts must stay disabled until we've yielded, otherwise we could be preempted (and
+	// never rescheduled) between suspending ourselves and joining the sleep queue.  This also
+	// keeps us on this core, so we can use its sleep queue and timer.
+	u64 flags = local_irq_save();
+
 	thread *ct = &thread::current();
 	ct->suspend();
 
-	sleeping_thread *st = new sleeping_thread { ct, wakeup_deadline };
-	sleeping_.append(st);
+	auto &q = queues_[core::this_core_id()];
+
+	u64 lock_flags;
+	q.lock.lock(&lock_flags);
+	q.sleepers.push(sleeping_thread { ct, wakeup_deadline });
+	q.lock.unlock(lock_flags);
 
 	// dprintf("sleeper: sleeping %p deadline=%lu\n", ct, wakeup_deadline);
 
+	// The new deadline may be earlier than the one the timer is currently programmed for.
+	core::this_core().local_timer().rearm();
+
 	asm volatile("int $0xff");
+
+	local_irq_restore(flags);
 }
 
-void sleeper::check_wakeup()
+bool sleeper::check_wakeup()
 {
 	u64 ref_time = x86_core::this_core().local_tsc().read();
+	auto &q = queues_[core::this_core_id()];
 
-	// TODO: some kind of priority queue
-	list<sleeping_thread *> resumed;
-	for (auto sleeping : sleeping_) {
-		if (ref_time > sleeping->wakeup_deadline) {
-			// dprintf("sleeper: waking %p\n", sleeping->thr);
-			sleeping->thr->resume();
-			resumed.append(sleeping);
-		}
-	}
+	unique_irq_lock l(q.lock);
 
-	for (auto resume : resumed) {
-		sleeping_.remove(resume);
+	bool woken = false;
+	while (!q.sleepers.empty() && q.sleepers.top().wakeup_deadline <= ref_time) {
+		// dprintf("sleeper: waking %p\n", q.sleepers.top().thr);
+		q.sleepers.pop().thr->resume();
+		woken = true;
 	}
+
+	return woken;
+}
+
+u64 sleeper::next_deadline()
+{
+	auto &q = queues_[core::this_core_id()];
+
+	unique_irq_lock l(q.lock);
+	return q.sleepers.empty() ? no_deadline : q.sleepers.top().wakeup_deadline;
 }
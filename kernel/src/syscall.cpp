@@ -38,13 +38,29 @@ static syscall_result do_open(process &owner, const char *path)
 		return syscall_result { syscall_result_code::not_supported, 0 };
 	}
 
-	auto file_object = object_manager::get().create_file_object(owner, file);
+	auto file_object = object_manager::get().create_file_object(owner, file, node);
 	return syscall_result { syscall_result_code::ok, file_object->id() };
 }
 
 static syscall_result operation_result_to_syscall_result(operation_result &&o)
 {
-	syscall_result_code rc = (syscall_result_code)o.code;
+	syscall_result_code rc;
+
+	switch (o.code) {
+	case operation_result_code::ok:
+		rc = syscall_result_code::ok;
+		break;
+	case operation_result_code::not_found:
+		rc = syscall_result_code::not_found;
+		break;
+	case operation_result_code::invalid_argument:
+		rc = syscall_result_code::invalid_argument;
+		break;
+	default:
+		rc = syscall_result_code::not_supported;
+		break;
+	}
+
 	return syscall_result { rc, o.data };
 }
 
@@ -121,11 +137,33 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 	}
 
 	case syscall_numbers::alloc_mem: {
-		auto rgn = current_thread.owner().addrspace().alloc_region(PAGE_ALIGN_UP(arg0), region_flags::readwrite, true);
+		region_flags flags = region_flags::readwrite;
+		if (arg1 != 0) {
+			flags |= region_flags::large_pages;
+		}
+
+		auto rgn = current_thread.owner().addrspace().alloc_region(PAGE_ALIGN_UP(arg0), flags, false);
 
 		return syscall_result { syscall_result_code::ok, rgn->base };
 	}
 
+	case syscall_numbers::free_mem: {
+		if (!current_thread.owner().addrspace().remove_region(arg0)) {
+			return syscall_result { syscall_result_code::invalid_argument, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, 0 };
+	}
+
+	case syscall_numbers::mmap: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->mmap(current_process.addrspace(), arg1, arg2, arg3 != 0));
+	}
+
 	case syscall_numbers::start_process: {
 		dprintf("start process: %s %s\n", arg0, arg1);
 
@@ -172,6 +210,33 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 		return operation_result_to_syscall_result(thread_object->join());
 	}
 
+	case syscall_numbers::set_thread_priority: {
+		auto thread_object = object_manager::get().get_object(current_process, arg0);
+		if (!thread_object) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(thread_object->set_priority(arg1, (s64)arg2));
+	}
+
+	case syscall_numbers::set_affinity: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->set_affinity(arg1));
+	}
+
+	case syscall_numbers::get_affinity: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->get_affinity());
+	}
+
 	case syscall_numbers::sleep: {
 		sleeper::get().sleep_ms(arg0);
 		return syscall_result { syscall_result_code::ok, 0 };
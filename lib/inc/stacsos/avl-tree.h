@@ -22,15 +22,18 @@ public:
 		, data_(data)
 		, left_(nullptr)
 		, right_(nullptr)
+		, height_(1)
 	{
 	}
 
-	int height() const
+	int height() const { return height_; }
+
+	void update_height()
 	{
 		int lh = left_ == nullptr ? 0 : left_->height();
 		int rh = right_ == nullptr ? 0 : right_->height();
 
-		return max(lh, rh) + 1;
+		height_ = max(lh, rh) + 1;
 	}
 
 	int balance_factor() const
@@ -55,6 +58,7 @@ private:
 	D data_;
 
 	avl_tree_node *left_, *right_;
+	int height_;
 };
 
 template <class N> struct avl_tree_iterator_pair {
@@ -131,6 +135,91 @@ public:
 
 	void add(const K &key, const D &data) { root_ = do_insert(root_, key, data); }
 
+	/**
+	 * @brief Removes the node with the given key from the tree.
+	 * @param key The key of the node to remove.
+	 * @return Returns true if a node was removed, or false if the key was not present.
+	 */
+	bool remove(const K &key)
+	{
+		bool removed = false;
+		root_ = do_remove(root_, key, removed);
+
+		return removed;
+	}
+
+	bool empty() const { return root_ == nullptr; }
+
+	/**
+	 * @brief Returns the node with the smallest key, or nullptr if the tree is empty.
+	 */
+	node *first() const
+	{
+		node *ref = root_;
+		while (ref && ref->left()) {
+			ref = ref->left();
+		}
+
+		return ref;
+	}
+
+	/**
+	 * @brief Returns the node with the largest key, or nullptr if the tree is empty.
+	 */
+	node *last() const
+	{
+		node *ref = root_;
+		while (ref && ref->right()) {
+			ref = ref->right();
+		}
+
+		return ref;
+	}
+
+	/**
+	 * @brief Returns the node with the largest key that is less than or equal to the given key, or
+	 * nullptr if there isn't one.
+	 */
+	node *floor(const K &key) const
+	{
+		node *ref = root_, *best = nullptr;
+		while (ref) {
+			if (key < ref->key()) {
+				ref = ref->left();
+			} else {
+				best = ref;
+				ref = ref->right();
+			}
+		}
+
+		return best;
+	}
+
+	/**
+	 * @brief Returns the node with the smallest key that is greater than or equal to the given key,
+	 * or nullptr if there isn't one.
+	 */
+	node *ceiling(const K &key) const
+	{
+		node *ref = root_, *best = nullptr;
+		while (ref) {
+			if (ref->key() < key) {
+				ref = ref->right();
+			} else {
+				best = ref;
+				ref = ref->left();
+			}
+		}
+
+		return best;
+	}
+
+	/**
+	 * @brief Returns the node with the smallest key for which the predicate holds, or nullptr if
+	 * there isn't one.  This visits the nodes in key order, so it's linear in the worst case.
+	 */
+	template <typename P> node *find_first(P pred) const { return do_find_first(root_, pred); }
+
 	bool try_get_value(const K &key, D &data)
 	{
 		node *ref = root_;
@@ -163,6 +252,10 @@ private:
 		node *t = ref->left();
 		ref->left(t->right());
 		t->right(ref);
+
+		ref->update_height();
+		t->update_height();
+
 		return t;
 	}
 
@@ -186,14 +279,19 @@ private:
 		ref->right(t->left());
 		t->left(ref);
 
+		ref->update_height();
+		t->update_height();
+
 		return t;
 	}
 
 	node *balance(node *ref)
 	{
+		ref->update_height();
+
 		int bf = ref->balance_factor();
 		if (bf > 1) {
-			if (ref->left()->balance_factor() > 0) {
+			if (ref->left()->balance_factor() >= 0) {
 				return ll_rot(ref);
 			} else {
 				return lr_rot(ref);
@@ -221,5 +319,69 @@ private:
 			return balance(ref);
 		}
 	}
+
+	node *do_remove(node *ref, const K &key, bool &removed)
+	{
+		if (ref == nullptr) {
+			return nullptr;
+		}
+
+		if (ref->key() == key) {
+			removed = true;
+
+			node *l = ref->left();
+			node *r = ref->right();
+			delete ref;
+
+			if (l == nullptr) {
+				return r;
+			} else if (r == nullptr) {
+				return l;
+			}
+
+			// Replace the removed node with its in-order successor.
+			node *successor;
+			r = detach_first(r, successor);
+
+			successor->left(l);
+			successor->right(r);
+			return balance(successor);
+		} else if (key < ref->key()) {
+			ref->left(do_remove(ref->left(), key, removed));
+		} else {
+			ref->right(do_remove(ref->right(), key, removed));
+		}
+
+		return balance(ref);
+	}
+
+	template <typename P> static node *do_find_first(node *ref, P &pred)
+	{
+		if (ref == nullptr) {
+			return nullptr;
+		}
+
+		node *found = do_find_first(ref->left(), pred);
+		if (found) {
+			return found;
+		}
+
+		if (pred(*ref)) {
+			return ref;
+		}
+
+		return do_find_first(ref->right(), pred);
+	}
+
+	node *detach_first(node *ref, node *&first)
+	{
+		if (ref->left() == nullptr) {
+			first = ref;
+			return ref->right();
+		}
+
+		ref->left(detach_first(ref->left(), first));
+		return balance(ref);
+	}
 };
 } // namespace stacsos
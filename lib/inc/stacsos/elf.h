@@ -43,6 +43,8 @@ enum class elf_header_machine : u16 {
 enum class elf_program_header_type : u32 { pt_null = 0, pt_load = 1, pt_dynamic = 2 };
 enum class elf_program_header_flags : u32 { pf_x = 1, pf_w = 2, pf_r = 4 };
 
+DEFINE_ENUM_FLAG_OPERATIONS(elf_program_header_flags)
+
 struct elf_ident_header {
 	u8 ei_magic[4];
 	elf_ident_classes ei_class;
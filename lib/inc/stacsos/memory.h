@@ -173,15 +173,15 @@ private:
 		if (refcount_ == nullptr) {
 			refcount_ = new u64(1);
 		} else {
-			(*refcount_)++;
+			// The count may be shared between cores, so it must be updated atomically.
+			__atomic_fetch_add(refcount_, 1, __ATOMIC_RELAXED);
 		}
 	}
 
 	void release()
 	{
 		if (refcount_ != nullptr) {
-			(*refcount_)--;
-			if (*refcount_ == 0) {
+			if (__atomic_sub_fetch(refcount_, 1, __ATOMIC_ACQ_REL) == 0) {
 				if (ptr_ != nullptr) {
 					(void)sizeof(T);
 					delete ptr_;
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/helpers.h>
+
+namespace stacsos {
+/**
+ * A binary min-heap.  The element that compares smallest (using operator<) is always at
+ * the top.  Storage grows by doubling, and is never shrunk.
+ */
+template <typename T> class priority_queue {
+	DELETE_DEFAULT_COPY_AND_MOVE(priority_queue)
+
+public:
+	priority_queue()
+		: storage_(nullptr)
+		, capacity_(0)
+		, count_(0)
+	{
+	}
+
+	~priority_queue() { delete[] storage_; }
+
+	bool empty() const { return count_ == 0; }
+	size_t count() const { return count_; }
+
+	const T &top() const { return storage_[0]; }
+
+	void push(const T &elem)
+	{
+		if (count_ == capacity_) {
+			grow();
+		}
+
+		storage_[count_] = elem;
+		sift_up(count_++);
+	}
+
+	T pop()
+	{
+		T top = storage_[0];
+
+		count_--;
+		if (count_ > 0) {
+			storage_[0] = storage_[count_];
+			sift_down(0);
+		}
+
+		return top;
+	}
+
+private:
+	T *storage_;
+	size_t capacity_;
+	size_t count_;
+
+	void grow()
+	{
+		size_t new_capacity = capacity_ == 0 ? 16 : capacity_ * 2;
+		T *new_storage = new T[new_capacity];
+
+		for (size_t i = 0; i < count_; i++) {
+			new_storage[i] = storage_[i];
+		}
+
+		delete[] storage_;
+		storage_ = new_storage;
+		capacity_ = new_capacity;
+	}
+
+	void sift_up(size_t index)
+	{
+		while (index > 0) {
+			size_t parent = (index - 1) / 2;
+			if (!(storage_[index] < storage_[parent])) {
+				break;
+			}
+
+			swap(storage_[index], storage_[parent]);
+			index = parent;
+		}
+	}
+
+	void sift_down(size_t index)
+	{
+		while (true) {
+			size_t left = (index * 2) + 1;
+			size_t right = left + 1;
+			size_t smallest = index;
+
+			if (left < count_ && storage_[left] < storage_[smallest]) {
+				smallest = left;
+			}
+
+			if (right < count_ && storage_[right] < storage_[smallest]) {
+				smallest = right;
+			}
+
+			if (smallest == index) {
+				break;
+			}
+
+			swap(storage_[index], storage_[smallest]);
+			index = smallest;
+		}
+	}
+};
+} // namespace stacsos
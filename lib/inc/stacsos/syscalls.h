@@ -8,7 +8,7 @@
 #pragma once
 
 namespace stacsos {
-enum class syscall_result_code : u64 { ok = 0, not_found = 1, not_supported = 2 };
+enum class syscall_result_code : u64 { ok = 0, not_found = 1, not_supported = 2, invalid_argument = 3 };
 
 enum class syscall_numbers {
 	exit = 0,
@@ -28,9 +28,18 @@ enum class syscall_numbers {
 	join_thread = 14,
 	sleep = 15,
 	poweroff = 16,
-	ioctl = 17
+	ioctl = 17,
+	set_thread_priority = 18,
+	set_affinity = 19,
+	get_affinity = 20,
+	mmap = 21,
+	free_mem = 22
 };
 
+// Real-time threads (priorities 0 to 31, higher runs first) always run in preference to fair-share
+// threads (priorities -20 to 19, lower gets a larger share).
+enum class thread_priority_class : u64 { fair = 0, realtime = 1 };
+
 struct syscall_result {
 	syscall_result_code code;
 	u64 data;
@@ -39,10 +39,15 @@ static void logo()
 			console::get().write("logo not found\n");
 		}
 
-		u8 *logo_data = new u8[170415];
-		logo_file->read(logo_data, 170415);
+		// Map the image, rather than reading it into a buffer: the mapping outlives the object.
+		const u8 *logo_data = (const u8 *)logo_file->mmap(0, 170415);
 		delete logo_file;
 
+		if (!logo_data) {
+			console::get().write("unable to map logo\n");
+			return;
+		}
+
 		logo_data++; // 0x50 P
 		logo_data++; // 0x36 6
 		logo_data++; // 0x0a
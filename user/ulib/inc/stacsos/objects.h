@@ -22,6 +22,8 @@ public:
 
 	u64 ioctl(u64 cmd, void *buffer, size_t length);
 
+	void *mmap(size_t offset, size_t length, bool writable = false);
+
 private:
 	u64 handle_;
 
@@ -14,6 +14,11 @@ public:
 
 	void wait_for_exit();
 
+	// Restricts all threads of this process to the given set of cores (bit n for core n).  Returns
+	// false if the set doesn't contain any online cores.
+	bool set_affinity(u64 affinity);
+	u64 get_affinity();
+
 private:
 	process(u64 handle)
 		: handle_(handle)
@@ -7,6 +7,8 @@
  */
 #pragma once
 
+#include <stacsos/syscalls.h>
+
 namespace stacsos {
 typedef void *(*thread_entry_fn)(void *);
 
@@ -24,6 +26,15 @@ public:
 
 	void *join();
 
+	// Changes the scheduling class and priority of this thread.  Returns false if the priority
+	// isn't valid for the class.
+	bool set_priority(thread_priority_class cls, s64 priority);
+
+	// Restricts this thread to the given set of cores (bit n for core n).  Returns false if the
+	// set doesn't contain any online cores.
+	bool set_affinity(u64 affinity);
+	u64 get_affinity();
+
 private:
 	thread(u64 handle, thread_context *tc)
 		: handle_(handle)
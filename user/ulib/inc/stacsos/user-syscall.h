@@ -70,9 +70,19 @@ public:
 		return rw_result { r.code, r.data };
 	}
 
-	static alloc_result alloc_mem(u64 size)
+	// Memory is only allocated as it is touched.  If large_pages is set, it's allocated (and zeroed)
+	// 2M at a time wherever possible, which is only worth it if most of it is going to be used.
+	static alloc_result alloc_mem(u64 size, bool large_pages = false)
 	{
-		auto r = syscall1(syscall_numbers::alloc_mem, size);
+		auto r = syscall2(syscall_numbers::alloc_mem, size, large_pages ? 1 : 0);
+		return alloc_result { r.code, (void *)r.data };
+	}
+
+	static syscall_result_code free_mem(void *ptr) { return syscall1(syscall_numbers::free_mem, (u64)ptr).code; }
+
+	static alloc_result mmap(u64 object, size_t offset, size_t length, bool writable)
+	{
+		auto r = syscall4(syscall_numbers::mmap, object, offset, length, writable ? 1 : 0);
 		return alloc_result { r.code, (void *)r.data };
 	}
 
@@ -82,6 +92,13 @@ public:
 	static syscall_result start_thread(void *entrypoint, void *arg) { return syscall2(syscall_numbers::start_thread, (u64)entrypoint, (u64)arg); }
 	static syscall_result join_thread(u64 id) { return syscall1(syscall_numbers::join_thread, id); }
 	static syscall_result stop_current_thread() { return syscall0(syscall_numbers::stop_current_thread); }
+	static syscall_result set_thread_priority(u64 id, thread_priority_class cls, s64 priority)
+	{
+		return syscall3(syscall_numbers::set_thread_priority, id, (u64)cls, (u64)priority);
+	}
+
+	static syscall_result set_affinity(u64 id, u64 affinity) { return syscall2(syscall_numbers::set_affinity, id, affinity); }
+	static syscall_result get_affinity(u64 id) { return syscall1(syscall_numbers::get_affinity, id); }
 
 	static syscall_result sleep(u64 ms) { return syscall1(syscall_numbers::sleep, ms); }
 
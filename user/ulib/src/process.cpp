@@ -22,3 +22,15 @@ process *process::create(const char *path, const char *args)
 }
 
 void process::wait_for_exit() { syscalls::wait_process(handle_); }
+
+bool process::set_affinity(u64 affinity)
+{
+	auto r = syscalls::set_affinity(handle_, affinity);
+	return r.code == syscall_result_code::ok;
+}
+
+u64 process::get_affinity()
+{
+	auto r = syscalls::get_affinity(handle_);
+	return r.data;
+}
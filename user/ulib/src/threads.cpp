@@ -33,3 +33,21 @@ void *thread::join()
 	auto r = syscalls::join_thread(handle_);
 	return tc_->result_;
 }
+
+bool thread::set_priority(thread_priority_class cls, s64 priority)
+{
+	auto r = syscalls::set_thread_priority(handle_, cls, priority);
+	return r.code == syscall_result_code::ok;
+}
+
+bool thread::set_affinity(u64 affinity)
+{
+	auto r = syscalls::set_affinity(handle_, affinity);
+	return r.code == syscall_result_code::ok;
+}
+
+u64 thread::get_affinity()
+{
+	auto r = syscalls::get_affinity(handle_);
+	return r.data;
+}